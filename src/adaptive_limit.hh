@@ -0,0 +1,182 @@
+#ifndef ADAPTIVE_LIMIT_HH_
+#define ADAPTIVE_LIMIT_HH_
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <utility>
+
+#include <boost/asio/awaitable.hpp>
+
+#include "options.hh"
+#include "fair_wait_queue.hh"
+
+struct AdaptiveLimitConfig {
+    bool enabled = true;
+    double initial = 20;
+    double min = 1;
+    double max = 1000;
+    // Latency increase over the baseline that is still considered normal
+    double tolerance = 1.5;
+    // Weight of a new estimate in the limit, between 0 and 1
+    double smoothing = 0.2;
+    // Factor applied to the limit on a failure
+    double backoff = 0.9;
+
+    static AdaptiveLimitConfig from_options(const Options &options) {
+        AdaptiveLimitConfig config;
+        config.enabled = options.get("adaptive-limit", config.enabled);
+        config.initial = options.get("adaptive-limit-initial", config.initial);
+        config.min = options.get("adaptive-limit-min", config.min);
+        config.max = options.get("adaptive-limit-max", config.max);
+        config.tolerance = options.get("adaptive-limit-tolerance", config.tolerance);
+
+        if(config.min < 1 || config.max < config.min || config.initial < config.min ||
+           config.initial > config.max) {
+            throw std::invalid_argument {
+                "--adaptive-limit-*: expected 1 <= min <= initial <= max"};
+        }
+        if(config.tolerance < 1) {
+            throw std::invalid_argument {"--adaptive-limit-tolerance must be at least 1"};
+        }
+        return config;
+    }
+};
+
+// Concurrency limit of a single upstream, adjusted from the observed
+// latency (gradient) and errors (multiplicative decrease).
+//
+// Two exponentially weighted averages of the fetch latency are kept: a
+// short one for the current latency and a long one as the baseline. Their
+// ratio is the gradient; while the current latency stays within
+// `tolerance` of the baseline, the limit grows by about its square root
+// per sample (the allowed queue), and it shrinks in proportion as soon as
+// latency rises above that. Failures cut the limit by `backoff`. The limit
+// only grows while it is actually used, so an idle upstream does not get
+// an inflated limit. Fetches waiting for a slot are served by flow (client)
+// in round robin order, like the fetch scheduler's permits, so a client's
+// large batch to an upstream doesn't hold up the others' fetches to it.
+// Not thread safe: use from a single executor.
+class AdaptiveLimiter {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // A slot of the limit, handed back on destruction. Report the outcome
+    // of the fetch with success() or failure(); a fetch dropped without
+    // either (e.g. cancelled) leaves the limit alone.
+    class Token {
+    public:
+        explicit Token(AdaptiveLimiter *limiter): m_limiter {limiter} {}
+        Token(Token &&other) noexcept: m_limiter {std::exchange(other.m_limiter, nullptr)} {}
+        Token &operator=(Token &&other) noexcept {
+            std::swap(m_limiter, other.m_limiter);
+            return *this;
+        }
+        ~Token() {
+            if(m_limiter) {
+                m_limiter->release();
+            }
+        }
+
+        void success(clock::duration latency) {
+            if(auto *limiter = std::exchange(m_limiter, nullptr)) {
+                limiter->on_success(latency);
+                limiter->release();
+            }
+        }
+
+        void failure() {
+            if(auto *limiter = std::exchange(m_limiter, nullptr)) {
+                limiter->on_failure();
+                limiter->release();
+            }
+        }
+
+    private:
+        AdaptiveLimiter *m_limiter;
+    };
+
+    explicit AdaptiveLimiter(const AdaptiveLimitConfig &config):
+        m_config {config}, m_limit {config.initial} {}
+
+    // Wait for a free slot. `flow` identifies the client and must stay
+    // valid while waiting; while clients wait, they take turns to get
+    // `weight` slots each.
+    boost::asio::awaitable<Token> acquire(const void *flow = nullptr, unsigned weight = 1) {
+        if(!m_config.enabled) {
+            co_return Token {nullptr};
+        }
+
+        if(m_inflight < current_limit() && m_waiters.empty()) {
+            ++m_inflight;
+        } else {
+            co_await m_waiters.wait(flow, weight, [this] { release(); });
+        }
+        co_return Token {this};
+    }
+
+    double limit() const {
+        return m_limit;
+    }
+
+    size_t inflight() const {
+        return m_inflight;
+    }
+
+private:
+    size_t current_limit() const {
+        return static_cast<size_t>(m_limit);
+    }
+
+    void on_success(clock::duration latency) {
+        const auto sample = std::chrono::duration<double>(latency).count();
+        if(m_long_latency == 0) {
+            m_long_latency = m_short_latency = sample;
+        }
+        m_short_latency = 0.9 * m_short_latency + 0.1 * sample;
+        m_long_latency = 0.99 * m_long_latency + 0.01 * sample;
+
+        // Let the baseline follow a lasting improvement quickly, e.g. after
+        // the upstream recovered
+        if(m_short_latency < m_long_latency) {
+            m_long_latency = m_short_latency;
+        }
+
+        const auto gradient =
+            std::clamp(m_config.tolerance * m_long_latency / m_short_latency, 0.5, 1.0);
+
+        // Don't grow a limit that is not in use
+        if(gradient == 1.0 && m_inflight < m_limit / 2) {
+            return;
+        }
+
+        const auto estimate = m_limit * gradient + std::sqrt(m_limit);
+        set_limit((1 - m_config.smoothing) * m_limit + m_config.smoothing * estimate);
+    }
+
+    void on_failure() {
+        set_limit(m_limit * m_config.backoff);
+    }
+
+    void set_limit(double limit) {
+        m_limit = std::clamp(limit, m_config.min, m_config.max);
+    }
+
+    void release() {
+        --m_inflight;
+        while(m_inflight < current_limit() && m_waiters.notify_one()) {
+            ++m_inflight;
+        }
+    }
+
+    const AdaptiveLimitConfig m_config;
+    double m_limit;
+    size_t m_inflight = 0;
+    double m_short_latency = 0;
+    double m_long_latency = 0;
+    FairWaitQueue m_waiters;
+};
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef ADMISSION_HH_
+#define ADMISSION_HH_
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <mutex>
+#include <stdexcept>
+
+#include "options.hh"
+
+struct AdmissionConfig {
+    // Jobs waiting for a work pool thread at most, 0 means unlimited
+    size_t max_queue = 1024;
+    // Estimated queue wait above which new jobs are refused, 0 disables
+    // the rule
+    std::chrono::steady_clock::duration max_wait = std::chrono::seconds(10);
+    // CoDel: queue wait considered acceptable, and the time it may be
+    // exceeded before jobs are dropped; a zero target disables CoDel
+    std::chrono::steady_clock::duration codel_target = std::chrono::milliseconds(100);
+    std::chrono::steady_clock::duration codel_interval = std::chrono::seconds(1);
+
+    static AdmissionConfig from_options(const Options &options) {
+        const auto seconds = [](double s) {
+            return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(s));
+        };
+
+        AdmissionConfig config;
+        config.max_queue = options.get("max-queue", config.max_queue);
+        config.max_wait = seconds(options.get("max-queue-wait", 10.0));
+        config.codel_target = seconds(options.get("codel-target", 0.1));
+        config.codel_interval = seconds(options.get("codel-interval", 1.0));
+
+        if(config.codel_target.count() > 0 && config.codel_interval <= config.codel_target) {
+            throw std::invalid_argument {
+                "--codel-interval must be longer than --codel-target"};
+        }
+        return config;
+    }
+};
+
+// Load shedding in front of the work pool.
+//
+// New jobs are refused when the queue is full or its estimated wait (the
+// queued jobs times the average job time, spread over the threads) is too
+// long. Jobs that were admitted are dropped when they get a thread, CoDel
+// style (RFC 8289): once the queue wait has stayed above `codel_target`
+// for a whole `codel_interval`, jobs are dropped at a rate growing with
+// the square root of the drops so far, until the wait falls below the
+// target again. Thread safe: jobs start and finish on work pool threads.
+class AdmissionController {
+public:
+    using clock = std::chrono::steady_clock;
+
+    enum class Verdict { admit, queue_full, too_slow };
+
+    explicit AdmissionController(const AdmissionConfig &config): m_config {config} {}
+
+    // Whether to queue a new job, given the jobs queued and the threads
+    // running them
+    Verdict admit(size_t queued, size_t threads) const {
+        if(m_config.max_queue > 0 && queued >= m_config.max_queue) {
+            return Verdict::queue_full;
+        }
+        if(m_config.max_wait.count() > 0 &&
+           estimated_wait(queued, threads) > m_config.max_wait) {
+            return Verdict::too_slow;
+        }
+        return Verdict::admit;
+    }
+
+    // Time a new job would wait for a thread
+    clock::duration estimated_wait(size_t queued, size_t threads) const {
+        std::lock_guard lock {m_mutex};
+        return std::chrono::duration_cast<clock::duration>(m_job_time * queued /
+                                                           std::max<size_t>(threads, 1));
+    }
+
+    // A job got a thread after waiting `sojourn`. Returns whether to drop it.
+    bool should_drop(clock::duration sojourn) {
+        if(m_config.codel_target.count() == 0) {
+            return false;
+        }
+
+        std::lock_guard lock {m_mutex};
+        const auto now = clock::now();
+
+        // The wait must stay above the target for an interval first
+        bool ok_to_drop = false;
+        if(sojourn < m_config.codel_target) {
+            m_first_above = {};
+        } else if(m_first_above == clock::time_point {}) {
+            m_first_above = now + m_config.codel_interval;
+        } else if(now >= m_first_above) {
+            ok_to_drop = true;
+        }
+
+        if(m_dropping) {
+            if(!ok_to_drop) {
+                m_dropping = false;
+            } else if(now >= m_drop_next) {
+                ++m_count;
+                m_drop_next = control_law(m_drop_next);
+                return true;
+            }
+            return false;
+        }
+
+        if(ok_to_drop) {
+            // Resume near the previous drop rate if dropping stopped only
+            // recently
+            m_dropping = true;
+            m_count = m_count > 2 && now - m_drop_next < 16 * m_config.codel_interval
+                          ? m_count - 2
+                          : 1;
+            m_drop_next = control_law(now);
+            return true;
+        }
+        return false;
+    }
+
+    // A job ran for `duration`
+    void finished(clock::duration duration) {
+        std::lock_guard lock {m_mutex};
+        m_job_time = m_job_time.count() == 0
+                         ? duration
+                         : std::chrono::duration_cast<clock::duration>(0.9 * m_job_time +
+                                                                       0.1 * duration);
+    }
+
+private:
+    clock::time_point control_law(clock::time_point t) const {
+        return t + std::chrono::duration_cast<clock::duration>(m_config.codel_interval /
+                                                               std::sqrt(m_count));
+    }
+
+    const AdmissionConfig m_config;
+
+    mutable std::mutex m_mutex;
+    // Exponentially weighted job run time
+    clock::duration m_job_time {0};
+
+    // CoDel state
+    clock::time_point m_first_above;
+    clock::time_point m_drop_next;
+    unsigned m_count = 0;
+    bool m_dropping = false;
+};
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef BALANCER_HH_
+#define BALANCER_HH_
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/system/error_code.hpp>
+
+#include "metrics.hh"
+#include "options.hh"
+
+struct BalancerConfig {
+    bool enabled = true;
+    // Consecutive failures after which an endpoint is ejected, 0 disables
+    // ejection
+    unsigned ejection_failures = 5;
+    // Ejection time, multiplied by the number of ejections in a row
+    std::chrono::steady_clock::duration ejection_time = std::chrono::seconds(10);
+
+    static BalancerConfig from_options(const Options &options) {
+        BalancerConfig config;
+        config.enabled = options.get("endpoint-balancing", config.enabled);
+        config.ejection_failures = options.get("ejection-failures", config.ejection_failures);
+        config.ejection_time = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(options.get("ejection-time", 10.0)));
+        return config;
+    }
+};
+
+// Choice between the resolved addresses of an upstream.
+//
+// The preferred endpoint is picked by the power of two choices: out of two
+// random endpoints, the one with the lower latency average times the
+// number of fetches in flight (plus one) wins. Endpoints without a latency
+// sample yet score zero, so new endpoints get tried. Endpoints failing
+// several times in a row are ejected for a while, unless all of them are.
+// Not thread safe: use from a single executor.
+class EndpointBalancer {
+public:
+    using clock = std::chrono::steady_clock;
+    using tcp = boost::asio::ip::tcp;
+
+private:
+    struct Stats {
+        // Exponentially weighted fetch latency in seconds, 0 without samples
+        double latency = 0;
+        size_t inflight = 0;
+        unsigned failures = 0;
+        unsigned ejections = 0;
+        clock::time_point ejected_until;
+    };
+
+public:
+    // A fetch in flight to an endpoint. Report its outcome with success()
+    // or failure(); a fetch dropped without either (e.g. cancelled) does
+    // not count.
+    class Lease {
+    public:
+        Lease(EndpointBalancer *balancer, Stats *stats):
+            m_balancer {balancer}, m_stats {stats} {
+            if(m_stats) {
+                ++m_stats->inflight;
+            }
+        }
+        Lease(Lease &&other) noexcept:
+            m_balancer {other.m_balancer}, m_stats {std::exchange(other.m_stats, nullptr)} {}
+        Lease &operator=(Lease &&other) noexcept {
+            std::swap(m_balancer, other.m_balancer);
+            std::swap(m_stats, other.m_stats);
+            return *this;
+        }
+        ~Lease() {
+            if(m_stats) {
+                --m_stats->inflight;
+            }
+        }
+
+        void success(clock::duration latency) {
+            if(auto *stats = std::exchange(m_stats, nullptr)) {
+                --stats->inflight;
+                m_balancer->on_success(*stats, latency);
+            }
+        }
+
+        void failure() {
+            if(auto *stats = std::exchange(m_stats, nullptr)) {
+                --stats->inflight;
+                m_balancer->on_failure(*stats);
+            }
+        }
+
+    private:
+        EndpointBalancer *m_balancer;
+        Stats *m_stats;
+    };
+
+    EndpointBalancer(const BalancerConfig &config, metrics::Counter &ejections):
+        m_config {config}, m_ejections {ejections}, m_rng {std::random_device {}()} {}
+
+    // Order endpoints for connection attempts: the pick first, then the
+    // others by score, ejected endpoints last
+    std::vector<tcp::endpoint> order(std::vector<tcp::endpoint> endpoints) {
+        if(!m_config.enabled || endpoints.size() < 2) {
+            return endpoints;
+        }
+
+        const auto now = clock::now();
+        const auto healthy_end =
+            std::stable_partition(endpoints.begin(), endpoints.end(),
+                                  [&](const auto &ep) { return !ejected(ep, now); });
+        const auto healthy = static_cast<size_t>(
+            healthy_end == endpoints.begin() ? endpoints.size()
+                                             : healthy_end - endpoints.begin());
+
+        std::stable_sort(endpoints.begin(), endpoints.begin() + healthy,
+                         [&](const auto &a, const auto &b) { return score(a) < score(b); });
+
+        if(healthy >= 2) {
+            std::uniform_int_distribution<size_t> dist {0, healthy - 1};
+            auto i = dist(m_rng);
+            auto j = dist(m_rng);
+            while(j == i) {
+                j = dist(m_rng);
+            }
+            // Sorted by score, so the lower index is the better choice
+            std::rotate(endpoints.begin(), endpoints.begin() + std::min(i, j),
+                        endpoints.begin() + std::min(i, j) + 1);
+        }
+
+        return endpoints;
+    }
+
+    // Outcome of a connection attempt
+    void report_connect(const tcp::endpoint &endpoint, boost::system::error_code ec) {
+        if(!m_config.enabled) {
+            return;
+        }
+        auto &stats = m_stats[endpoint];
+        if(ec) {
+            on_failure(stats);
+        } else {
+            stats.failures = 0;
+        }
+    }
+
+    // Count a fetch in flight to `endpoint`
+    Lease lease(const tcp::endpoint &endpoint) {
+        return {this, m_config.enabled ? &m_stats[endpoint] : nullptr};
+    }
+
+private:
+    bool ejected(const tcp::endpoint &endpoint, clock::time_point now) const {
+        const auto it = m_stats.find(endpoint);
+        return it != m_stats.end() && it->second.ejected_until > now;
+    }
+
+    double score(const tcp::endpoint &endpoint) const {
+        const auto it = m_stats.find(endpoint);
+        if(it == m_stats.end()) {
+            return 0;
+        }
+        return it->second.latency * (it->second.inflight + 1);
+    }
+
+    void on_success(Stats &stats, clock::duration latency) {
+        const auto sample = std::chrono::duration<double>(latency).count();
+        stats.latency = stats.latency == 0 ? sample : 0.7 * stats.latency + 0.3 * sample;
+        stats.failures = 0;
+        stats.ejections = 0;
+    }
+
+    void on_failure(Stats &stats) {
+        if(m_config.ejection_failures == 0 || ++stats.failures < m_config.ejection_failures) {
+            return;
+        }
+
+        stats.failures = 0;
+        ++stats.ejections;
+        stats.ejected_until = clock::now() + m_config.ejection_time * stats.ejections;
+        m_ejections.inc();
+    }
+
+    const BalancerConfig m_config;
+    metrics::Counter &m_ejections;
+    std::minstd_rand m_rng;
+    std::map<tcp::endpoint, Stats> m_stats;
+};
+
+#endif
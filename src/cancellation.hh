@@ -0,0 +1,53 @@
+#ifndef CANCELLATION_HH_
+#define CANCELLATION_HH_
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <vector>
+
+#include <boost/asio/bind_cancellation_slot.hpp>
+#include <boost/asio/cancellation_signal.hpp>
+#include <boost/asio/cancellation_type.hpp>
+
+// Cancellation of a group of detached coroutines, e.g. everything spawned
+// on behalf of a websocket client session. Not thread safe: spawn and
+// cancel from a single executor.
+class CancellationGroup {
+public:
+    // Completion token for co_spawn() binding the coroutine to a new
+    // signal of the group. The signal is owned by the completion handler,
+    // so it lives as long as the coroutine does.
+    auto token() {
+        auto signal = std::make_shared<boost::asio::cancellation_signal>();
+        add(signal);
+        return boost::asio::bind_cancellation_slot(signal->slot(),
+                                                   [signal](std::exception_ptr) {});
+    }
+
+    // Cancel the coroutines of the group that are still running
+    void emit(boost::asio::cancellation_type type = boost::asio::cancellation_type::terminal) {
+        for(const auto &weak : m_signals) {
+            if(const auto signal = weak.lock()) {
+                signal->emit(type);
+            }
+        }
+    }
+
+private:
+    void add(const std::shared_ptr<boost::asio::cancellation_signal> &signal) {
+        // Forget finished coroutines once in a while, keeping add() O(1)
+        // amortized
+        if(m_signals.size() >= m_prune_at) {
+            std::erase_if(m_signals, [](const auto &weak) { return weak.expired(); });
+            m_prune_at = std::max<size_t>(16, m_signals.size() * 2);
+        }
+        m_signals.push_back(signal);
+    }
+
+    std::vector<std::weak_ptr<boost::asio::cancellation_signal>> m_signals;
+    size_t m_prune_at = 16;
+};
+
+#endif
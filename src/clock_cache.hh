@@ -0,0 +1,104 @@
+#ifndef CLOCK_CACHE_HH_
+#define CLOCK_CACHE_HH_
+
+#include <sys/time.h>
+#include <time.h>
+
+#include <cmath>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "spdlog/fmt/fmt.h"
+
+// Current time formatted for responses, cached per thread. The local time
+// is formatted down to the second once per second; only the milliseconds
+// are written on every call. The HTTP Date header changes once per
+// second, so it is reformatted only then.
+class ClockCache {
+public:
+    // Local time as "YYYY-MM-DD HH:MM:SS.mmm". Valid until the next call
+    // on the same thread.
+    std::string_view local_time() {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+        if(ts.tv_sec != m_local_second) {
+            struct tm tm_info;
+            localtime_r(&ts.tv_sec, &tm_info);
+            m_local_prefix = strftime(m_local, sizeof(m_local) - 3, "%F %T.", &tm_info);
+            m_local_second = ts.tv_sec;
+        }
+
+        const auto millisec = ts.tv_nsec / 1000000;
+        m_local[m_local_prefix] = static_cast<char>('0' + millisec / 100);
+        m_local[m_local_prefix + 1] = static_cast<char>('0' + millisec / 10 % 10);
+        m_local[m_local_prefix + 2] = static_cast<char>('0' + millisec % 10);
+        return {m_local, m_local_prefix + 3};
+    }
+
+    // Value of the HTTP Date header (RFC 7231 IMF-fixdate), e.g.
+    // "Sun, 06 Nov 1994 08:49:37 GMT". Valid until the next call on the
+    // same thread.
+    std::string_view http_date() {
+        const auto now = time(nullptr);
+        if(now != m_date_second) {
+            struct tm tm_info;
+            gmtime_r(&now, &tm_info);
+            m_date_size =
+                strftime(m_date, sizeof(m_date), "%a, %d %b %Y %H:%M:%S GMT", &tm_info);
+            m_date_second = now;
+        }
+        return {m_date, m_date_size};
+    }
+
+private:
+    time_t m_local_second = -1;
+    size_t m_local_prefix = 0;
+    char m_local[64];
+
+    time_t m_date_second = -1;
+    size_t m_date_size = 0;
+    char m_date[64];
+};
+
+inline ClockCache &
+clock_cache() {
+    thread_local ClockCache instance;
+    return instance;
+}
+
+// Local time formatted from scratch, the way sleepy-server did before the
+// cache; kept as the baseline for benchmarks
+inline std::string
+format_local_time() {
+    char buffer[26];
+    int millisec;
+    struct tm tm_info;
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    millisec = lrint(tv.tv_usec / 1000.0); // Round to nearest millisec
+    if(millisec >= 1000) {                 // Allow for rounding up to nearest second
+        millisec -= 1000;
+        tv.tv_sec++;
+    }
+
+    localtime_r(&tv.tv_sec, &tm_info);
+
+    strftime(buffer, 26, "%F %T", &tm_info);
+    return fmt::format("{}.{:03d}", buffer, millisec);
+}
+
+// HTTP Date header formatted from scratch, the baseline for http_date()
+inline std::string
+format_http_date() {
+    char buffer[64];
+    struct tm tm_info;
+    const auto now = time(nullptr);
+    gmtime_r(&now, &tm_info);
+    return {buffer, strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm_info)};
+}
+
+#endif
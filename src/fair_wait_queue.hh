@@ -0,0 +1,125 @@
+#ifndef FAIR_WAIT_QUEUE_HH_
+#define FAIR_WAIT_QUEUE_HH_
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/experimental/channel.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+// Coroutines of several flows (e.g. clients) waiting for some shared
+// capacity, woken by deficit round robin.
+//
+// While several flows wait, they take turns: on its turn a flow is woken
+// for as many units as its weight, so a flow with few waiters waits for at
+// most one turn of every other flow instead of behind all of their
+// waiters. Within a flow, waiters are woken in FIFO order. The owner of
+// the capacity hands it out with notify_one(), and a waiter cancelled after
+// being notified gives it back through the callback passed to wait(). Not
+// thread safe: use from a single executor.
+class FairWaitQueue {
+public:
+    // Wait until notify_one() picks this coroutine. `flow` identifies the
+    // flow of the waiter and must stay valid while it waits.
+    boost::asio::awaitable<void> wait(const void *flow, unsigned weight,
+                                      std::function<void()> give_back) {
+        auto waiter = std::make_shared<Waiter>(co_await boost::asio::this_coro::executor);
+
+        const auto [it, added] = m_flows.try_emplace(flow);
+        if(added) {
+            m_turns.push_back(flow);
+        }
+        it->second.weight = weight > 0 ? weight : 1;
+        it->second.waiters.push_back(waiter);
+        ++m_size;
+
+        try {
+            co_await waiter->chan.async_receive(boost::asio::use_awaitable);
+        } catch(...) {
+            waiter->abandoned = true;
+            if(waiter->notified) {
+                give_back();
+            } else {
+                --m_size;
+            }
+            throw;
+        }
+    }
+
+    // Wake the first waiter of the flow whose turn it is. Returns false if
+    // nobody is waiting.
+    bool notify_one() {
+        while(!m_turns.empty()) {
+            const auto it = m_flows.find(m_turns.front());
+            auto &flow = it->second;
+
+            while(!flow.waiters.empty() && flow.waiters.front()->abandoned) {
+                flow.waiters.pop_front();
+            }
+            if(flow.waiters.empty()) {
+                m_flows.erase(it);
+                m_turns.pop_front();
+                continue;
+            }
+
+            // A flow starting its turn may take `weight` units
+            if(flow.deficit == 0) {
+                flow.deficit = flow.weight;
+            }
+
+            const auto waiter = std::move(flow.waiters.front());
+            flow.waiters.pop_front();
+            --m_size;
+            waiter->notified = true;
+            waiter->chan.try_send(boost::system::error_code {});
+
+            if(flow.waiters.empty()) {
+                m_flows.erase(it);
+                m_turns.pop_front();
+            } else if(--flow.deficit == 0) {
+                m_turns.push_back(m_turns.front());
+                m_turns.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Number of coroutines waiting
+    size_t size() const {
+        return m_size;
+    }
+
+    bool empty() const {
+        return m_size == 0;
+    }
+
+private:
+    struct Waiter {
+        explicit Waiter(boost::asio::any_io_executor ex): chan {ex, 1} {}
+
+        boost::asio::experimental::channel<void(boost::system::error_code)> chan;
+        bool notified = false;
+        bool abandoned = false;
+    };
+
+    struct Flow {
+        unsigned weight = 1;
+        size_t deficit = 0;
+        std::deque<std::shared_ptr<Waiter>> waiters;
+    };
+
+    // Flows with waiters, in the order of their turns: the front one has
+    // the turn
+    std::map<const void *, Flow> m_flows;
+    std::deque<const void *> m_turns;
+    size_t m_size = 0;
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef FAULT_INJECTION_HH_
+#define FAULT_INJECTION_HH_
+
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <stdexcept>
+
+#include "options.hh"
+
+struct FaultConfig {
+    // Seed of the random delays and faults; runs with the same seed and
+    // the same request order behave the same
+    uint64_t seed = 1;
+    // Share of responses replaced with a 500 error, an abrupt connection
+    // reset, or a body cut in half. May be overridden per request.
+    double error_rate = 0;
+    double reset_rate = 0;
+    double truncate_rate = 0;
+
+    static FaultConfig from_options(const Options &options) {
+        FaultConfig config;
+        config.seed = options.get("seed", config.seed);
+        config.error_rate = options.get("error-rate", config.error_rate);
+        config.reset_rate = options.get("reset-rate", config.reset_rate);
+        config.truncate_rate = options.get("truncate-rate", config.truncate_rate);
+
+        if(!valid_rates(config.error_rate, config.reset_rate, config.truncate_rate)) {
+            throw std::invalid_argument {
+                "--error-rate, --reset-rate and --truncate-rate must be between 0 and 1, "
+                "and add up to at most 1"};
+        }
+        return config;
+    }
+
+    static bool valid_rates(double error, double reset, double truncate) {
+        return error >= 0 && reset >= 0 && truncate >= 0 && error + reset + truncate <= 1;
+    }
+};
+
+enum class Fault { none, error, reset, truncate };
+
+// Seeded source of response delays and injected faults. Not thread safe:
+// use from a single executor.
+class FaultInjector {
+public:
+    explicit FaultInjector(const FaultConfig &config):
+        m_config {config}, m_rng {config.seed} {}
+
+    // Delay whose logarithm is normally distributed
+    double lognormal(double mu, double sigma) {
+        return std::lognormal_distribution<double> {mu, sigma}(m_rng);
+    }
+
+    // Pareto distributed delay, at least `scale`; heavy tailed for small
+    // `alpha`
+    double pareto(double scale, double alpha) {
+        const auto u = 1 - std::uniform_real_distribution<double> {0, 1}(m_rng);
+        return scale / std::pow(u, 1 / alpha);
+    }
+
+    // `slow` with probability `p_slow`, `fast` otherwise
+    double bimodal(double fast, double slow, double p_slow) {
+        return std::bernoulli_distribution {p_slow}(m_rng) ? slow : fast;
+    }
+
+    // Fault for a response, with the configured rates
+    Fault fault() {
+        return fault(m_config.error_rate, m_config.reset_rate, m_config.truncate_rate);
+    }
+
+    Fault fault(double error_rate, double reset_rate, double truncate_rate) {
+        auto x = std::uniform_real_distribution<double> {0, 1}(m_rng);
+        if((x -= error_rate) < 0) {
+            return Fault::error;
+        }
+        if((x -= reset_rate) < 0) {
+            return Fault::reset;
+        }
+        if((x -= truncate_rate) < 0) {
+            return Fault::truncate;
+        }
+        return Fault::none;
+    }
+
+    const FaultConfig &config() const {
+        return m_config;
+    }
+
+private:
+    const FaultConfig m_config;
+    std::mt19937_64 m_rng;
+};
+
+#endif
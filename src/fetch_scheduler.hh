@@ -0,0 +1,106 @@
+#ifndef FETCH_SCHEDULER_HH_
+#define FETCH_SCHEDULER_HH_
+
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <utility>
+
+#include <boost/asio/awaitable.hpp>
+
+#include "fair_wait_queue.hh"
+
+// Limits the number of concurrent upstream fetches and shares them between
+// clients by deficit round robin.
+//
+// Every client gets a flow with a weight. While fetches are waiting, flows
+// take turns: on its turn a flow may start as many fetches as its weight,
+// so a client with a small batch waits for at most one turn of every other
+// client instead of behind a large batch. Within a flow, fetches start in
+// FIFO order. Not thread safe: use from a single executor.
+class FetchScheduler {
+public:
+    class Flow;
+
+    // Right to run one fetch, returned to the scheduler on destruction
+    class Permit {
+    public:
+        Permit() = default;
+        explicit Permit(FetchScheduler *scheduler): m_scheduler {scheduler} {}
+        Permit(Permit &&other) noexcept:
+            m_scheduler {std::exchange(other.m_scheduler, nullptr)} {}
+        Permit &operator=(Permit &&other) noexcept {
+            std::swap(m_scheduler, other.m_scheduler);
+            return *this;
+        }
+        ~Permit() {
+            if(m_scheduler) {
+                m_scheduler->release();
+            }
+        }
+
+    private:
+        FetchScheduler *m_scheduler = nullptr;
+    };
+
+    // Scheduling state of a single client
+    class Flow: public std::enable_shared_from_this<Flow> {
+    public:
+        Flow(FetchScheduler &scheduler, unsigned weight):
+            m_scheduler {scheduler}, m_weight {weight > 0 ? weight : 1} {}
+
+        // Wait until this flow may start a fetch
+        boost::asio::awaitable<Permit> acquire() {
+            return m_scheduler.acquire(shared_from_this());
+        }
+
+        unsigned weight() const {
+            return m_weight;
+        }
+
+    private:
+        FetchScheduler &m_scheduler;
+        const unsigned m_weight;
+    };
+
+    // `limit` concurrent fetches, 0 means unlimited
+    explicit FetchScheduler(size_t limit):
+        m_limit {limit > 0 ? limit : std::numeric_limits<size_t>::max()} {}
+
+    FetchScheduler(const FetchScheduler &) = delete;
+    FetchScheduler &operator=(const FetchScheduler &) = delete;
+
+    // Register a client. The scheduler must outlive its flows.
+    std::shared_ptr<Flow> flow(unsigned weight) {
+        return std::make_shared<Flow>(*this, weight);
+    }
+
+    // Fetches running
+    size_t inflight() const {
+        return m_inflight;
+    }
+
+private:
+    boost::asio::awaitable<Permit> acquire(std::shared_ptr<Flow> flow) {
+        if(m_inflight < m_limit && m_waiters.empty()) {
+            ++m_inflight;
+        } else {
+            co_await m_waiters.wait(flow.get(), flow->weight(), [this] { release(); });
+        }
+        co_return Permit {this};
+    }
+
+    // Hand the permit to the next waiting flow in round robin order
+    void release() {
+        --m_inflight;
+        while(m_inflight < m_limit && m_waiters.notify_one()) {
+            ++m_inflight;
+        }
+    }
+
+    const size_t m_limit;
+    size_t m_inflight = 0;
+    FairWaitQueue m_waiters;
+};
+
+#endif
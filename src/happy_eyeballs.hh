@@ -0,0 +1,265 @@
+#ifndef HAPPY_EYEBALLS_HH_
+#define HAPPY_EYEBALLS_HH_
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/experimental/channel.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/system/system_error.hpp>
+
+// Happy Eyeballs (RFC 8305) connection racing.
+//
+// Resolved endpoints are interleaved by address family and connection
+// attempts are started with a fixed stagger delay, or immediately when the
+// previous attempt fails. The first attempt to succeed wins and all the
+// other attempts are cancelled.
+namespace happy_eyeballs {
+
+namespace net = boost::asio;
+using boost::system::error_code;
+using net::ip::tcp;
+
+// "Connection Attempt Delay" recommended by RFC 8305, section 5
+constexpr std::chrono::milliseconds connection_attempt_delay {250};
+
+// Reorder endpoints as described in RFC 8305, section 4: alternate address
+// families, starting with the family of the first endpoint.
+inline std::vector<tcp::endpoint>
+interleave_families(const std::vector<tcp::endpoint> &candidates) {
+    std::vector<tcp::endpoint> preferred, other;
+
+    for(const auto &ep : candidates) {
+        if(preferred.empty() || ep.protocol() == preferred.front().protocol()) {
+            preferred.push_back(ep);
+        } else {
+            other.push_back(ep);
+        }
+    }
+
+    std::vector<tcp::endpoint> endpoints;
+    endpoints.reserve(preferred.size() + other.size());
+
+    for(size_t i = 0; i < preferred.size() || i < other.size(); ++i) {
+        if(i < preferred.size()) {
+            endpoints.push_back(preferred[i]);
+        }
+        if(i < other.size()) {
+            endpoints.push_back(other[i]);
+        }
+    }
+
+    return endpoints;
+}
+
+inline std::vector<tcp::endpoint>
+endpoints_of(const tcp::resolver::results_type &results) {
+    std::vector<tcp::endpoint> endpoints;
+    for(const auto &entry : results) {
+        endpoints.push_back(entry.endpoint());
+    }
+    return endpoints;
+}
+
+namespace detail {
+
+using attempt_channel = net::experimental::channel<void(error_code, size_t)>;
+using socket_setup = std::function<void(tcp::socket &)>;
+using attempt_report = std::function<void(const tcp::endpoint &, error_code)>;
+
+// State shared by the racing coroutine, connection attempts and timer
+// handlers. Everything runs on a single executor, so no locking is needed.
+struct race_state: std::enable_shared_from_this<race_state> {
+    race_state(net::any_io_executor ex, std::vector<tcp::endpoint> endpoints_,
+               socket_setup setup_, attempt_report report_,
+               std::chrono::steady_clock::duration delay_):
+        executor {ex},
+        endpoints {std::move(endpoints_)},
+        setup {std::move(setup_)},
+        report {std::move(report_)},
+        delay {delay_},
+        started(endpoints.size(), false),
+        chan {ex, endpoints.size()} {
+        sockets.reserve(endpoints.size());
+        timers.reserve(endpoints.size());
+        for(size_t i = 0; i < endpoints.size(); ++i) {
+            sockets.emplace_back(ex);
+            timers.emplace_back(ex);
+        }
+    }
+
+    // Start attempt `i` unless it has already been started or the race is over
+    void start(size_t i);
+
+    // Stop the race: unstarted attempts are reported as failed with `ec`,
+    // in-progress attempts are aborted by closing their sockets.
+    void abort(error_code ec) {
+        if(!done) {
+            reason = ec;
+        }
+        done = true;
+        for(size_t i = 0; i < endpoints.size(); ++i) {
+            timers[i].cancel();
+            if(!started[i]) {
+                started[i] = true;
+                chan.try_send(ec, i);
+            } else if(sockets[i].is_open()) {
+                error_code ignored;
+                sockets[i].close(ignored);
+            }
+        }
+    }
+
+    net::any_io_executor executor;
+    std::vector<tcp::endpoint> endpoints;
+    socket_setup setup;
+    attempt_report report;
+    std::chrono::steady_clock::duration delay;
+    std::vector<bool> started;
+    std::vector<tcp::socket> sockets;
+    std::vector<net::steady_timer> timers;
+
+    // Every attempt reports exactly once, so the channel never blocks
+    attempt_channel chan;
+    bool done = false;
+    error_code reason;
+};
+
+inline net::awaitable<void>
+attempt(std::shared_ptr<race_state> state, size_t i) {
+    error_code ec;
+    auto &socket = state->sockets[i];
+
+    if(state->done) {
+        state->chan.try_send(net::error::operation_aborted, i);
+        co_return;
+    }
+
+    // Give this attempt a head start before racing the next one
+    state->timers[i].expires_after(state->delay);
+    state->timers[i].async_wait([state, i](error_code ec) {
+        if(!ec) {
+            state->start(i + 1);
+        }
+    });
+
+    socket.open(state->endpoints[i].protocol(), ec);
+    if(!ec && state->setup) {
+        state->setup(socket);
+    }
+    if(!ec) {
+        co_await socket.async_connect(state->endpoints[i],
+                                      net::redirect_error(net::use_awaitable, ec));
+    }
+
+    // Attempts aborted because the race is over say nothing about the
+    // endpoint, but those cut off by the deadline timed out
+    if(ec == net::error::operation_aborted && state->reason == net::error::timed_out) {
+        ec = net::error::timed_out;
+    }
+    if(state->report && ec != net::error::operation_aborted) {
+        state->report(state->endpoints[i], ec);
+    }
+
+    if(ec) {
+        // Don't wait for the stagger delay if this attempt has failed
+        state->timers[i].cancel();
+        state->start(i + 1);
+    }
+
+    state->chan.try_send(ec, i);
+}
+
+inline void
+race_state::start(size_t i) {
+    if(done || i >= endpoints.size() || started[i]) {
+        return;
+    }
+
+    started[i] = true;
+    net::co_spawn(executor, attempt(shared_from_this(), i), net::detached);
+}
+
+} // namespace detail
+
+// Connect `socket` to one of `candidates`, racing connection attempts in
+// order of preference. Fails with the error of the last attempt if none
+// succeeds, or with `net::error::timed_out` if `timeout` expires first.
+// `setup` is called for every socket after it is opened and before it
+// connects, `report` with the outcome of every attempt that completes or
+// times out.
+inline net::awaitable<tcp::endpoint>
+async_connect(tcp::socket &socket, const std::vector<tcp::endpoint> &candidates,
+              std::chrono::steady_clock::duration timeout,
+              detail::socket_setup setup = {}, detail::attempt_report report = {},
+              std::chrono::steady_clock::duration delay = connection_attempt_delay) {
+    auto endpoints = interleave_families(candidates);
+    if(endpoints.empty()) {
+        throw boost::system::system_error {net::error::host_not_found};
+    }
+
+    const auto n = endpoints.size();
+    auto state = std::make_shared<detail::race_state>(co_await net::this_coro::executor,
+                                                      std::move(endpoints), std::move(setup),
+                                                      std::move(report), delay);
+
+    net::steady_timer deadline {state->executor};
+    deadline.expires_after(timeout);
+    deadline.async_wait([state](error_code ec) {
+        if(!ec) {
+            state->abort(net::error::timed_out);
+        }
+    });
+
+    // Make sure no attempt outlives the race if we leave early
+    struct abort_guard {
+        ~abort_guard() {
+            state->abort(net::error::operation_aborted);
+        }
+        std::shared_ptr<detail::race_state> state;
+    } guard {state};
+
+    state->start(0);
+
+    error_code last_error = net::error::host_unreachable;
+    for(size_t failed = 0; failed < n; ++failed) {
+        error_code ec;
+        const auto i =
+            co_await state->chan.async_receive(net::redirect_error(net::use_awaitable, ec));
+
+        if(!ec) {
+            deadline.cancel();
+            socket = std::move(state->sockets[i]);
+            co_return state->endpoints[i];
+        }
+
+        last_error = ec;
+    }
+
+    throw boost::system::system_error {state->reason ? state->reason : last_error};
+}
+
+// Same, trying the resolved endpoints in the order of the resolver
+inline net::awaitable<tcp::endpoint>
+async_connect(tcp::socket &socket, const tcp::resolver::results_type &results,
+              std::chrono::steady_clock::duration timeout,
+              detail::socket_setup setup = {}, detail::attempt_report report = {},
+              std::chrono::steady_clock::duration delay = connection_attempt_delay) {
+    co_return co_await async_connect(socket, endpoints_of(results), timeout, std::move(setup),
+                                     std::move(report), delay);
+}
+
+} // namespace happy_eyeballs
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef IO_BACKEND_HH_
+#define IO_BACKEND_HH_
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(BOOST_ASIO_HAS_IO_URING)
+#include <liburing.h>
+#endif
+
+#include "spdlog/spdlog.h"
+
+// Selection between the epoll and io_uring builds of a binary.
+//
+// asio picks its reactor at compile time, so io_uring support comes as a
+// separate build of each server (`<name>-uring`, see the ASIO_IO_URING
+// cmake option). Both builds accept `--io-backend=auto|epoll|io_uring` and
+// re-execute the sibling build when the other backend is requested, or
+// when the kernel does not support io_uring.
+namespace io_backend {
+
+#if defined(BOOST_ASIO_HAS_IO_URING) && defined(BOOST_ASIO_DISABLE_EPOLL)
+constexpr std::string_view compiled = "io_uring";
+#else
+constexpr std::string_view compiled = "epoll";
+#endif
+
+constexpr std::string_view uring_suffix = "-uring";
+
+// Check that io_uring can actually be used (old kernels return ENOSYS,
+// it may also be disabled by seccomp or the io_uring_disabled sysctl)
+inline bool
+uring_supported(std::string &reason) {
+#if defined(BOOST_ASIO_HAS_IO_URING)
+    struct io_uring ring;
+    if(const auto rc = io_uring_queue_init(1, &ring, 0); rc < 0) {
+        reason = std::strerror(-rc);
+        return false;
+    }
+    io_uring_queue_exit(&ring);
+    return true;
+#else
+    reason = "not compiled in";
+    return false;
+#endif
+}
+
+// Replace the current process with the other build of this binary. The
+// backend is passed on explicitly, so the sibling never bounces back. Only
+// returns if that is not possible.
+inline void
+exec_sibling(std::string_view backend, char **argv) {
+    std::error_code ec;
+    auto path = std::filesystem::read_symlink("/proc/self/exe", ec).string();
+    if(ec) {
+        spdlog::error("cannot locate own executable: {}", ec.message());
+        return;
+    }
+
+    if(backend == "io_uring") {
+        path += uring_suffix;
+    } else if(path.ends_with(uring_suffix)) {
+        path.resize(path.size() - uring_suffix.size());
+    }
+
+    // Later flags override earlier ones
+    auto flag = "--io-backend=" + std::string {backend};
+    std::vector<char *> args;
+    for(auto **arg = argv; *arg; ++arg) {
+        args.push_back(*arg);
+    }
+    args.push_back(flag.data());
+    args.push_back(nullptr);
+
+    spdlog::info("switching to the {} build {}", backend, path);
+    ::execv(path.c_str(), args.data());
+    spdlog::error("cannot execute {}: {}", path, std::strerror(errno));
+}
+
+// Make sure the process runs on the requested backend, re-executing the
+// sibling build if needed. Falls back to the compiled-in backend if the
+// sibling is unavailable, and to epoll if io_uring is unusable.
+inline void
+select(const std::string &requested, char **argv) {
+    if(requested != "auto" && requested != "epoll" && requested != "io_uring") {
+        throw std::invalid_argument {"--io-backend: expected 'auto', 'epoll' or 'io_uring', "
+                                     "got '" +
+                                     requested + "'"};
+    }
+
+    std::string reason;
+    if(compiled == "io_uring") {
+        if(!uring_supported(reason)) {
+            spdlog::warn("io_uring is not available ({}), falling back to epoll", reason);
+            exec_sibling("epoll", argv);
+            throw std::runtime_error {"no usable IO backend"};
+        }
+        if(requested == "epoll") {
+            exec_sibling("epoll", argv);
+        }
+    } else if(requested == "io_uring") {
+        exec_sibling("io_uring", argv);
+        spdlog::warn("io_uring build not available, using epoll");
+    }
+
+    spdlog::info("using {} IO backend", compiled);
+}
+
+} // namespace io_backend
+
+#endif
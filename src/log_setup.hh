@@ -0,0 +1,107 @@
+#ifndef LOG_SETUP_HH_
+#define LOG_SETUP_HH_
+
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "spdlog/async.h"
+#include "spdlog/sinks/stdout_color_sinks.h"
+#include "spdlog/spdlog.h"
+
+#include "options.hh"
+
+// Logging settings shared by all binaries.
+//
+// In async mode log records are formatted on the calling thread and
+// written to stdout by a dedicated spdlog thread, so IO threads never wait
+// on the terminal. Per-request messages use the SPDLOG_* macros and can be
+// compiled out with -DLOG_ACTIVE_LEVEL=<level> in cmake.
+struct LogConfig {
+    std::string level = "info";
+    bool async = true;
+    size_t queue_size = 8192;
+    // What to do when the async queue is full: "block" or "drop" (discard
+    // the oldest queued record)
+    std::string overflow = "drop";
+    // Maximum number of characters of a request or response body in a log
+    // record, 0 means unlimited
+    size_t body_limit = 256;
+
+    static LogConfig from_options(const Options &options) {
+        LogConfig config;
+        config.level = options.get("log-level", config.level);
+        config.async = options.get("log-async", config.async);
+        config.queue_size = options.get("log-queue-size", config.queue_size);
+        config.overflow = options.get("log-overflow", config.overflow);
+        config.body_limit = options.get("log-body-limit", config.body_limit);
+
+        if(config.overflow != "block" && config.overflow != "drop") {
+            throw std::invalid_argument {"--log-overflow: expected 'block' or 'drop', got '" +
+                                         config.overflow + "'"};
+        }
+        if(spdlog::level::from_str(config.level) == spdlog::level::off &&
+           config.level != "off") {
+            throw std::invalid_argument {"--log-level: unknown level '" + config.level + "'"};
+        }
+        if(config.queue_size == 0) {
+            throw std::invalid_argument {"--log-queue-size must be positive"};
+        }
+        return config;
+    }
+};
+
+namespace log_setup {
+
+inline size_t body_limit = 256;
+
+// Body text cut down to the configured limit for logging
+struct Truncated {
+    std::string_view text;
+    size_t size;
+};
+
+inline Truncated
+truncated(std::string_view text) {
+    return {body_limit && text.size() > body_limit ? text.substr(0, body_limit) : text,
+            text.size()};
+}
+
+} // namespace log_setup
+
+template <>
+struct fmt::formatter<log_setup::Truncated>: fmt::formatter<std::string_view> {
+    template <typename FormatContext>
+    auto format(const log_setup::Truncated &t, FormatContext &ctx) const
+        -> decltype(ctx.out()) {
+        auto out = fmt::formatter<std::string_view>::format(t.text, ctx);
+        if(t.text.size() < t.size) {
+            out = fmt::format_to(out, "... ({} bytes)", t.size);
+        }
+        return out;
+    }
+};
+
+// Install the default logger according to `config`. Must be called before
+// any other thread starts logging.
+inline void
+setup_logging(const LogConfig &config) {
+    if(config.async) {
+        spdlog::init_thread_pool(config.queue_size, 1);
+
+        const auto policy = config.overflow == "block"
+                                ? spdlog::async_overflow_policy::block
+                                : spdlog::async_overflow_policy::overrun_oldest;
+        auto sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
+        auto logger = std::make_shared<spdlog::async_logger>("", std::move(sink),
+                                                             spdlog::thread_pool(), policy);
+        spdlog::set_default_logger(std::move(logger));
+    }
+
+    spdlog::set_level(spdlog::level::from_str(config.level));
+    log_setup::body_limit = config.body_limit;
+}
+
+#endif
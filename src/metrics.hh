@@ -0,0 +1,351 @@
+#ifndef METRICS_HH_
+#define METRICS_HH_
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "spdlog/fmt/fmt.h"
+
+// Metrics registry with Prometheus text exposition.
+//
+// Metrics are registered once (usually at startup) and then updated
+// through plain references. Updates are single relaxed atomic operations,
+// so they are cheap enough for per-request hot paths. Only registration
+// and rendering take the registry lock.
+namespace metrics {
+
+using Labels = std::vector<std::pair<std::string, std::string>>;
+
+class Metric {
+public:
+    virtual ~Metric() = default;
+
+    // Append exposition lines for this metric to `out`
+    virtual void render(std::string &out, const std::string &name,
+                        const std::string &labels) const = 0;
+};
+
+// Monotonically increasing counter
+class Counter: public Metric {
+public:
+    void inc(uint64_t n = 1) noexcept {
+        m_value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const noexcept {
+        return m_value.load(std::memory_order_relaxed);
+    }
+
+    void render(std::string &out, const std::string &name,
+                const std::string &labels) const override {
+        fmt::format_to(std::back_inserter(out), "{}{} {}\n", name, labels, value());
+    }
+
+private:
+    std::atomic<uint64_t> m_value {0};
+};
+
+// Value that can go up and down
+class Gauge: public Metric {
+public:
+    void set(int64_t v) noexcept {
+        m_value.store(v, std::memory_order_relaxed);
+    }
+
+    void inc(int64_t n = 1) noexcept {
+        m_value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void dec(int64_t n = 1) noexcept {
+        m_value.fetch_sub(n, std::memory_order_relaxed);
+    }
+
+    int64_t value() const noexcept {
+        return m_value.load(std::memory_order_relaxed);
+    }
+
+    void render(std::string &out, const std::string &name,
+                const std::string &labels) const override {
+        fmt::format_to(std::back_inserter(out), "{}{} {}\n", name, labels, value());
+    }
+
+private:
+    std::atomic<int64_t> m_value {0};
+};
+
+// Increments a gauge for the lifetime of the object
+class ScopedGauge {
+public:
+    explicit ScopedGauge(Gauge &gauge): m_gauge(gauge) {
+        m_gauge.inc();
+    }
+
+    ~ScopedGauge() {
+        m_gauge.dec();
+    }
+
+    ScopedGauge(const ScopedGauge &) = delete;
+    ScopedGauge &operator=(const ScopedGauge &) = delete;
+
+private:
+    Gauge &m_gauge;
+};
+
+// Log-linear latency histogram with microsecond resolution.
+//
+// Every power-of-two range [2^k, 2^(k+1)) is split into `sub_buckets`
+// linear buckets, so the relative error of any recorded value is below
+// 1/sub_buckets: 128 sub-buckets keep it under 1%, close to an
+// HdrHistogram with two significant digits, which is what tail quantiles
+// need. Values above the largest bucket are clamped into it.
+class Histogram: public Metric {
+public:
+    static constexpr unsigned sub_bucket_bits = 7;
+    static constexpr unsigned sub_buckets = 1 << sub_bucket_bits;
+    static constexpr unsigned max_exponent = 37; // 2^37 us is more than a day
+    static constexpr unsigned n_buckets = (max_exponent - sub_bucket_bits + 2) * sub_buckets;
+
+    static constexpr unsigned bucket_index(uint64_t us) noexcept {
+        if(us < sub_buckets) {
+            return static_cast<unsigned>(us);
+        }
+
+        const unsigned k = std::bit_width(us) - 1;
+        const unsigned sub = (us >> (k - sub_bucket_bits)) & (sub_buckets - 1);
+        const unsigned index = (k - sub_bucket_bits + 1) * sub_buckets + sub;
+        return index < n_buckets ? index : n_buckets - 1;
+    }
+
+    // Exclusive upper bound of bucket `i`, in microseconds
+    static constexpr uint64_t bucket_upper_bound(unsigned i) noexcept {
+        if(i < sub_buckets) {
+            return i + 1;
+        }
+
+        const unsigned k = i / sub_buckets + sub_bucket_bits - 1;
+        const uint64_t sub = i % sub_buckets;
+        return (sub_buckets + sub + 1) << (k - sub_bucket_bits);
+    }
+
+    void observe_us(uint64_t us) noexcept {
+        m_buckets[bucket_index(us)].fetch_add(1, std::memory_order_relaxed);
+        m_sum_us.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    template <typename Rep, typename Period>
+    void observe(std::chrono::duration<Rep, Period> d) noexcept {
+        const auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        observe_us(us > 0 ? static_cast<uint64_t>(us) : 0);
+    }
+
+    uint64_t count() const noexcept {
+        uint64_t n = 0;
+        for(const auto &b : m_buckets) {
+            n += b.load(std::memory_order_relaxed);
+        }
+        return n;
+    }
+
+    uint64_t sum_us() const noexcept {
+        return m_sum_us.load(std::memory_order_relaxed);
+    }
+
+    // Smallest bucket bound below which `q` (0..1) of the values lie, in
+    // microseconds
+    uint64_t quantile_us(double q) const noexcept {
+        const auto total = count();
+        if(total == 0) {
+            return 0;
+        }
+
+        const auto rank = static_cast<uint64_t>(q * static_cast<double>(total - 1)) + 1;
+        uint64_t seen = 0;
+        for(unsigned i = 0; i < n_buckets; ++i) {
+            seen += m_buckets[i].load(std::memory_order_relaxed);
+            if(seen >= rank) {
+                return bucket_upper_bound(i);
+            }
+        }
+        return bucket_upper_bound(n_buckets - 1);
+    }
+
+    // Bucket bounds exposed to Prometheus per power of two, as a number of
+    // bits: all 128 would make for thousands of series per histogram
+    static constexpr unsigned exported_sub_bucket_bits = 2;
+
+    // Whether bucket bound `upper` is exposed: bounds with at most
+    // exported_sub_bucket_bits + 1 significant bits, e.g. 1, 1.25, 1.5 and
+    // 1.75 times a power of two
+    static constexpr bool exported(uint64_t upper) noexcept {
+        const unsigned width = std::bit_width(upper);
+        const unsigned bits = exported_sub_bucket_bits + 1;
+        return width <= bits || (upper & ((uint64_t {1} << (width - bits)) - 1)) == 0;
+    }
+
+    // The exposed boundaries coincide with bucket bounds, so the cumulative
+    // counts stay exact.
+    void render(std::string &out, const std::string &name,
+                const std::string &labels) const override {
+        const auto le_labels = [&](const std::string &le) {
+            if(labels.empty()) {
+                return fmt::format("{{le=\"{}\"}}", le);
+            }
+            return fmt::format("{},le=\"{}\"}}", labels.substr(0, labels.size() - 1), le);
+        };
+
+        uint64_t cumulative = 0;
+        for(unsigned i = 0; i < n_buckets; ++i) {
+            cumulative += m_buckets[i].load(std::memory_order_relaxed);
+
+            const auto upper = bucket_upper_bound(i);
+            if(i + 1 < n_buckets && exported(upper)) {
+                fmt::format_to(std::back_inserter(out), "{}_bucket{} {}\n", name,
+                               le_labels(fmt::format("{}", static_cast<double>(upper) / 1e6)),
+                               cumulative);
+            }
+        }
+
+        fmt::format_to(std::back_inserter(out), "{}_bucket{} {}\n", name, le_labels("+Inf"),
+                       cumulative);
+        fmt::format_to(std::back_inserter(out), "{}_sum{} {}\n", name, labels,
+                       sum_us() * 1e-6);
+        fmt::format_to(std::back_inserter(out), "{}_count{} {}\n", name, labels, cumulative);
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, n_buckets> m_buckets {};
+    std::atomic<uint64_t> m_sum_us {0};
+};
+
+class Registry {
+public:
+    Counter &counter(const std::string &name, const std::string &help,
+                     const Labels &labels = {}) {
+        return get<Counter>(name, help, "counter", labels);
+    }
+
+    Gauge &gauge(const std::string &name, const std::string &help,
+                 const Labels &labels = {}) {
+        return get<Gauge>(name, help, "gauge", labels);
+    }
+
+    Histogram &histogram(const std::string &name, const std::string &help,
+                         const Labels &labels = {}) {
+        return get<Histogram>(name, help, "histogram", labels);
+    }
+
+    // Unregister the series `name` with `labels`, e.g. of an object that
+    // goes away. References to it must not be used anymore.
+    void remove(const std::string &name, const Labels &labels) {
+        std::lock_guard lock {m_mutex};
+
+        const auto it = m_families.find(name);
+        if(it == m_families.end()) {
+            return;
+        }
+        it->second.series.erase(render_labels(labels));
+        if(it->second.series.empty()) {
+            m_families.erase(it);
+        }
+    }
+
+    // Render all registered metrics in Prometheus text format, version 0.0.4
+    std::string render() const {
+        std::lock_guard lock {m_mutex};
+        std::string out;
+
+        for(const auto &[name, family] : m_families) {
+            fmt::format_to(std::back_inserter(out), "# HELP {} {}\n# TYPE {} {}\n", name,
+                           family.help, name, family.type);
+            for(const auto &[labels, metric] : family.series) {
+                metric->render(out, name, labels);
+            }
+        }
+
+        return out;
+    }
+
+private:
+    struct Family {
+        std::string help;
+        std::string type;
+        std::map<std::string, std::unique_ptr<Metric>> series;
+    };
+
+    static std::string escape(const std::string &value) {
+        std::string result;
+        for(const auto c : value) {
+            switch(c) {
+            case '\\':
+                result += "\\\\";
+                break;
+            case '"':
+                result += "\\\"";
+                break;
+            case '\n':
+                result += "\\n";
+                break;
+            default:
+                result += c;
+            }
+        }
+        return result;
+    }
+
+    static std::string render_labels(const Labels &labels) {
+        if(labels.empty()) {
+            return {};
+        }
+
+        std::string result = "{";
+        for(const auto &[key, value] : labels) {
+            if(result.size() > 1) {
+                result += ',';
+            }
+            result += key + "=\"" + escape(value) + "\"";
+        }
+        return result + "}";
+    }
+
+    // Registering the same name and labels twice returns the same metric
+    template <typename T>
+    T &get(const std::string &name, const std::string &help, const char *type,
+           const Labels &labels) {
+        std::lock_guard lock {m_mutex};
+
+        auto &family = m_families[name];
+        if(family.type.empty()) {
+            family.help = help;
+            family.type = type;
+        }
+
+        auto &metric = family.series[render_labels(labels)];
+        if(!metric) {
+            metric = std::make_unique<T>();
+        }
+        return dynamic_cast<T &>(*metric);
+    }
+
+    mutable std::mutex m_mutex;
+    std::map<std::string, Family> m_families;
+};
+
+// Process-wide registry
+inline Registry &
+registry() {
+    static Registry instance;
+    return instance;
+}
+
+} // namespace metrics
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef METRICS_HTTP_HH_
+#define METRICS_HTTP_HH_
+
+#include <chrono>
+#include <exception>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/version.hpp>
+
+#include "spdlog/fmt/ostr.h"
+#include "spdlog/spdlog.h"
+
+#include "metrics.hh"
+
+// Serves the process-wide metrics registry at `/metrics` over HTTP
+namespace metrics {
+
+namespace detail {
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+using net::ip::tcp;
+
+inline net::awaitable<void>
+http_client(beast::tcp_stream stream) {
+    beast::error_code ec;
+    beast::flat_buffer buffer;
+
+    stream.expires_after(std::chrono::seconds(30));
+
+    try {
+        http::request<http::string_body> req;
+        co_await http::async_read(stream, buffer, req, net::use_awaitable);
+
+        http::response<http::string_body> res;
+        res.version(req.version());
+        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+
+        if(req.method() != http::verb::get) {
+            res.result(http::status::method_not_allowed);
+            res.set(http::field::content_type, "text/plain");
+            res.body() = "Unknown HTTP-method\n";
+        } else if(req.target() == "/metrics") {
+            res.result(http::status::ok);
+            res.set(http::field::content_type, "text/plain; version=0.0.4");
+            res.body() = registry().render();
+        } else {
+            res.result(http::status::not_found);
+            res.set(http::field::content_type, "text/plain");
+            res.body() = "Not found\n";
+        }
+        res.prepare_payload();
+
+        co_await http::async_write(stream, res, net::use_awaitable);
+    } catch(const std::exception &e) {
+        spdlog::error("metrics http_client got exception {}", e.what());
+    }
+
+    stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+}
+
+} // namespace detail
+
+// Accept scrape connections on `endpoint` until the io_context stops
+inline boost::asio::awaitable<void>
+serve(boost::asio::ip::tcp::endpoint endpoint) {
+    namespace net = boost::asio;
+    using net::ip::tcp;
+
+    auto ioc = co_await net::this_coro::executor;
+    boost::beast::error_code ec;
+
+    tcp::acceptor acceptor(ioc);
+    acceptor.open(endpoint.protocol(), ec);
+    if(!ec) {
+        acceptor.set_option(net::socket_base::reuse_address(true), ec);
+    }
+    if(!ec) {
+        acceptor.bind(endpoint, ec);
+    }
+    if(!ec) {
+        acceptor.listen(net::socket_base::max_listen_connections, ec);
+    }
+    if(ec) {
+        spdlog::error("metrics: cannot listen on {}: {}", endpoint, ec.message());
+        co_return;
+    }
+
+    spdlog::info("serving metrics on http://{}/metrics", endpoint);
+    for(;;) {
+        tcp::socket socket {ioc};
+        co_await acceptor.async_accept(socket, net::use_awaitable);
+        net::co_spawn(ioc, detail::http_client(boost::beast::tcp_stream {std::move(socket)}),
+                      net::detached);
+    }
+}
+
+} // namespace metrics
+
+#endif
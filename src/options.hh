@@ -0,0 +1,109 @@
+#ifndef OPTIONS_HH_
+#define OPTIONS_HH_
+
+#include <charconv>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+
+// Minimal command line parser for `--name=value` style flags. A flag
+// without a value (`--name`) is equivalent to `--name=true`. Flags are
+// looked up as the configuration is read; reject_unknown() then catches
+// the flags nothing looked up, such as misspelled ones.
+class Options {
+public:
+    Options() = default;
+
+    Options(int argc, char **argv) {
+        for(int i = 1; i < argc; ++i) {
+            std::string_view arg {argv[i]};
+
+            if(!arg.starts_with("--") || arg.size() == 2) {
+                throw std::invalid_argument {"unexpected argument '" + std::string {arg} +
+                                             "'"};
+            }
+            arg.remove_prefix(2);
+
+            const auto eq = arg.find('=');
+            if(eq == std::string_view::npos) {
+                m_values[std::string {arg}] = "true";
+            } else {
+                m_values[std::string {arg.substr(0, eq)}] = std::string {arg.substr(eq + 1)};
+            }
+        }
+    }
+
+    bool has(const std::string &name) const {
+        m_known.insert(name);
+        return m_values.contains(name);
+    }
+
+    // Get the value of flag `name`, or `def` if it has not been given.
+    // Throws std::invalid_argument if the value cannot be converted to T.
+    template <typename T>
+    T get(const std::string &name, T def) const {
+        m_known.insert(name);
+        const auto it = m_values.find(name);
+        if(it == m_values.end()) {
+            return def;
+        }
+
+        return parse<T>(name, it->second);
+    }
+
+    std::string get(const std::string &name, const char *def) const {
+        return get<std::string>(name, def);
+    }
+
+    // Throws std::invalid_argument if a flag was given that has not been
+    // looked up with get() or has()
+    void reject_unknown() const {
+        std::string unknown;
+        for(const auto &[name, value] : m_values) {
+            if(!m_known.contains(name)) {
+                unknown += (unknown.empty() ? "--" : ", --") + name;
+            }
+        }
+        if(!unknown.empty()) {
+            throw std::invalid_argument {"unknown flags: " + unknown};
+        }
+    }
+
+private:
+    template <typename T>
+    static T parse(const std::string &name, const std::string &value) {
+        if constexpr(std::is_same_v<T, std::string>) {
+            return value;
+        } else if constexpr(std::is_same_v<T, bool>) {
+            if(value == "true" || value == "1" || value == "yes" || value == "on") {
+                return true;
+            }
+            if(value == "false" || value == "0" || value == "no" || value == "off") {
+                return false;
+            }
+            throw std::invalid_argument {"--" + name + ": expected a boolean, got '" + value +
+                                         "'"};
+        } else {
+            static_assert(std::is_arithmetic_v<T>, "unsupported option type");
+
+            T result {};
+            const auto *first = value.data();
+            const auto *last = value.data() + value.size();
+            const auto [ptr, ec] = std::from_chars(first, last, result);
+            if(ec != std::errc {} || ptr != last) {
+                throw std::invalid_argument {"--" + name + ": expected a number, got '" +
+                                             value + "'"};
+            }
+            return result;
+        }
+    }
+
+    std::map<std::string, std::string> m_values;
+    // Flags looked up so far
+    mutable std::set<std::string> m_known;
+};
+#endif
@@ -0,0 +1,470 @@
+#if defined(__clang__)
+#include <experimental/coroutine>
+#elif defined(__GNUC__)
+#include <coroutine>
+#endif
+
+#include <time.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/write.hpp>
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include "CxxUrl/url.hpp"
+
+#include "spdlog/sinks/stdout_color_sinks.h"
+#include "spdlog/spdlog.h"
+
+#include "clock_cache.hh"
+#include "options.hh"
+#include "proxy_protocol.hh"
+#include "response_template.hh"
+#include "router.hh"
+#include "socket_options.hh"
+
+// Microbenchmarks for the websocket-proxy hot path. Results are printed
+// as JSON in the layout used by Google Benchmark, so the usual comparison
+// tools can be used to track regressions between releases.
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+namespace logging = spdlog;
+
+using boost::system::error_code;
+using net::ip::tcp;
+
+// Keep the compiler from optimizing away a computed value
+template <typename T>
+inline void
+do_not_optimize(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct BenchResult {
+    std::string name;
+    uint64_t iterations;
+    double real_ns;
+    double cpu_ns;
+};
+
+double
+cpu_time_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+class Bench {
+public:
+    explicit Bench(const Options &options):
+        m_min_time {options.get("min-time", 0.5)}, m_filter {options.get("filter", "")} {}
+
+    // Run `fn(n)`, which must perform `n` operations, with growing `n`
+    // until it takes at least the minimum time
+    void run(const std::string &name, const std::function<void(uint64_t)> &fn) {
+        if(name.find(m_filter) == std::string::npos) {
+            return;
+        }
+
+        for(uint64_t n = 1;;) {
+            const auto cpu_start = cpu_time_ns();
+            const auto start = std::chrono::steady_clock::now();
+            fn(n);
+            const auto elapsed = std::chrono::duration<double>(
+                                     std::chrono::steady_clock::now() - start)
+                                     .count();
+            const auto cpu_elapsed = cpu_time_ns() - cpu_start;
+
+            if(elapsed >= m_min_time || n >= (uint64_t {1} << 32)) {
+                m_results.push_back({name, n, elapsed * 1e9 / n, cpu_elapsed / n});
+                return;
+            }
+
+            // Aim slightly above the minimum time, but grow at most 10x
+            const auto target = elapsed > 0 ? n * m_min_time * 1.2 / elapsed : n * 10.0;
+            n = std::clamp<uint64_t>(static_cast<uint64_t>(target), n + 1, n * 10);
+        }
+    }
+
+    void print_json() const {
+        fmt::print("{{\n  \"context\": {{\n    \"executable\": \"proxy-bench\",\n"
+                   "    \"min_time\": {}\n  }},\n  \"benchmarks\": [\n",
+                   m_min_time);
+        for(size_t i = 0; i < m_results.size(); ++i) {
+            const auto &r = m_results[i];
+            fmt::print("    {{\"name\": \"{}\", \"iterations\": {}, \"real_time\": {:.3f}, "
+                       "\"cpu_time\": {:.3f}, \"time_unit\": \"ns\"}}{}\n",
+                       r.name, r.iterations, r.real_ns, r.cpu_ns,
+                       i + 1 < m_results.size() ? "," : "");
+        }
+        fmt::print("  ]\n}}\n");
+    }
+
+private:
+    double m_min_time;
+    std::string m_filter;
+    std::vector<BenchResult> m_results;
+};
+
+std::string
+make_batch_line(size_t n) {
+    std::string line;
+    for(size_t i = 0; i < n; ++i) {
+        line += fmt::format("http://localhost:8081/{}.{} ", i % 10, i);
+    }
+    return line + "\n";
+}
+
+std::vector<FetchResult>
+make_results(size_t n) {
+    std::vector<FetchResult> results;
+    for(size_t i = 0; i < n; ++i) {
+        FetchResult r;
+        if(i % 10) {
+            r.result = Ok {fmt::format("Slept {:.3f} s from 2022-01-01 00:00:00.000 to "
+                                       "2022-01-01 00:00:01.000",
+                                       i * 0.001)};
+        } else {
+            r.result = Err {std::string {"Connection refused"}};
+        }
+        r.timings.queue = std::chrono::microseconds(10);
+        r.timings.resolve = std::chrono::microseconds(120);
+        r.timings.connect = std::chrono::microseconds(50);
+        r.timings.write = std::chrono::microseconds(20);
+        r.timings.read = std::chrono::microseconds(1000);
+        results.push_back(r);
+    }
+    return results;
+}
+
+void
+bench_url(Bench &bench) {
+    bench.run("url_parse", [](uint64_t n) {
+        for(uint64_t i = 0; i < n; ++i) {
+            Url url {"http://localhost:8081/2.5"};
+            do_not_optimize(url.host());
+            do_not_optimize(url.port());
+            do_not_optimize(url.path());
+        }
+    });
+}
+
+void
+bench_parse_batch(Bench &bench) {
+    for(const size_t size : {1, 10, 100, 1000}) {
+        const auto line = make_batch_line(size);
+        bench.run(fmt::format("parse_batch/{}", size), [&](uint64_t n) {
+            for(uint64_t i = 0; i < n; ++i) {
+                do_not_optimize(parse_batch(line));
+            }
+        });
+    }
+}
+
+void
+bench_result(Bench &bench) {
+    const std::string body = "Slept 2.000 s from 2022-01-01 00:00:00.000 to "
+                             "2022-01-01 00:00:02.000";
+
+    bench.run("result_construct", [&](uint64_t n) {
+        for(uint64_t i = 0; i < n; ++i) {
+            FetchResult r;
+            r.result = Ok {body};
+            do_not_optimize(r);
+        }
+    });
+
+    // Transfer through a channel between two coroutines, the way
+    // http_get_multiple() collects results
+    bench.run("result_channel_transfer", [&](uint64_t n) {
+        net::io_context ioc;
+        result_channel chan {ioc.get_executor()};
+
+        const auto producer = [&]() -> net::awaitable<void> {
+            for(uint64_t i = 0; i < n; ++i) {
+                FetchResult r;
+                r.result = Ok {body};
+                co_await chan.async_send(error_code {}, r, net::use_awaitable);
+            }
+        };
+        const auto consumer = [&]() -> net::awaitable<void> {
+            for(uint64_t i = 0; i < n; ++i) {
+                do_not_optimize(co_await chan.async_receive(net::use_awaitable));
+            }
+        };
+
+        net::co_spawn(ioc, producer(), net::detached);
+        net::co_spawn(ioc, consumer(), net::detached);
+        ioc.run();
+    });
+}
+
+void
+bench_format(Bench &bench) {
+    for(const size_t size : {10, 100, 1000}) {
+        const auto results = make_results(size);
+        for(const bool timings : {false, true}) {
+            bench.run(fmt::format("format_results/{}{}", size, timings ? "/timings" : ""),
+                      [&](uint64_t n) {
+                          for(uint64_t i = 0; i < n; ++i) {
+                              do_not_optimize(format_results(results, timings));
+                          }
+                      });
+        }
+    }
+}
+
+void
+bench_response_parse(Bench &bench) {
+    for(const size_t size : {64, 4096, 65536}) {
+        http::response<http::string_body> res {http::status::ok, 11};
+        res.set(http::field::server, "Boost.Beast");
+        res.set(http::field::content_type, "text/html");
+        res.body() = std::string(size, 'x');
+        res.prepare_payload();
+
+        std::ostringstream os;
+        os << res;
+        const auto wire = os.str();
+
+        // Same body type as http_get()
+        bench.run(fmt::format("response_parse/{}", size), [&](uint64_t n) {
+            for(uint64_t i = 0; i < n; ++i) {
+                http::response_parser<http::dynamic_body> parser;
+                error_code ec;
+                parser.eager(true);
+                parser.put(net::buffer(wire), ec);
+                do_not_optimize(parser.is_done());
+            }
+        });
+    }
+}
+
+// sleepy-server request routing: the std::regex it used to build for every
+// request, the same regex built once, and the precompiled router
+void
+bench_routing(Bench &bench) {
+    const auto *pattern = "/((\\d+\\.)?\\d+)";
+
+    for(const std::string target : {"/2.5", "/not-found"}) {
+        const auto suffix = target == "/2.5" ? "match" : "miss";
+
+        bench.run(fmt::format("route/{}/regex_per_request", suffix), [&](uint64_t n) {
+            for(uint64_t i = 0; i < n; ++i) {
+                std::smatch sm;
+                do_not_optimize(std::regex_match(target, sm, std::regex {pattern}));
+            }
+        });
+
+        const std::regex re {pattern};
+        bench.run(fmt::format("route/{}/regex_precompiled", suffix), [&](uint64_t n) {
+            for(uint64_t i = 0; i < n; ++i) {
+                std::smatch sm;
+                do_not_optimize(std::regex_match(target, sm, re));
+            }
+        });
+
+        const auto router = Router<int> {}.add("/{number}", 0);
+        bench.run(fmt::format("route/{}/router", suffix), [&](uint64_t n) {
+            for(uint64_t i = 0; i < n; ++i) {
+                do_not_optimize(router.match(target));
+            }
+        });
+    }
+}
+
+// Body and headers of a sleepy-server sleep response, serialized
+size_t
+sleepy_response(bool cached) {
+    const auto time_string = [&] {
+        return cached ? std::string {clock_cache().local_time()} : format_local_time();
+    };
+    const auto t1 = time_string();
+    const auto t2 = time_string();
+    const auto date = cached ? std::string {clock_cache().http_date()} : format_http_date();
+
+    http::response<http::string_body> res {http::status::ok, 11};
+    res.set(http::field::server, "Boost.Beast");
+    res.set(http::field::date, date);
+    res.set(http::field::content_type, "text/html");
+    res.body() = fmt::format("Slept {:.3f} s from {} to {}", 0.01, t1, t2);
+    res.prepare_payload();
+
+    std::ostringstream os;
+    os << res;
+    return os.str().size();
+}
+
+// sleepy-server response generation, formatting the time stamps from
+// scratch as it used to, or through the per-thread clock cache
+void
+bench_clock(Bench &bench) {
+    bench.run("clock/local_time/uncached", [](uint64_t n) {
+        for(uint64_t i = 0; i < n; ++i) {
+            do_not_optimize(format_local_time());
+        }
+    });
+    bench.run("clock/local_time/cached", [](uint64_t n) {
+        for(uint64_t i = 0; i < n; ++i) {
+            do_not_optimize(clock_cache().local_time());
+        }
+    });
+    bench.run("clock/http_date/uncached", [](uint64_t n) {
+        for(uint64_t i = 0; i < n; ++i) {
+            do_not_optimize(format_http_date());
+        }
+    });
+    bench.run("clock/http_date/cached", [](uint64_t n) {
+        for(uint64_t i = 0; i < n; ++i) {
+            do_not_optimize(clock_cache().http_date());
+        }
+    });
+
+    for(const bool cached : {false, true}) {
+        bench.run(fmt::format("sleepy_response/{}", cached ? "cached" : "uncached"),
+                  [&](uint64_t n) {
+                      for(uint64_t i = 0; i < n; ++i) {
+                          do_not_optimize(sleepy_response(cached));
+                      }
+                  });
+    }
+}
+
+// sleepy-server 404 response, built and serialized by Beast, or from a
+// template serialized once. Both take the cached date, so only the
+// serialization differs.
+void
+bench_static_response(Bench &bench) {
+    bench.run("static_response/beast", [](uint64_t n) {
+        for(uint64_t i = 0; i < n; ++i) {
+            const auto date = clock_cache().http_date();
+            http::response<http::string_body> res {http::status::not_found, 11};
+            res.set(http::field::server, "Boost.Beast");
+            res.set(http::field::date, beast::string_view {date.data(), date.size()});
+            res.set(http::field::content_type, "text/html");
+            res.body() = "Not found\n";
+            res.keep_alive(true);
+            res.prepare_payload();
+
+            http::response_serializer<http::string_body> sr {res};
+            error_code ec;
+            size_t size = 0;
+            sr.next(ec, [&](error_code &, const auto &buffers) {
+                size = net::buffer_size(buffers);
+                sr.consume(size);
+            });
+            do_not_optimize(size);
+        }
+    });
+
+    const ResponseTemplate not_found {http::status::not_found, "Boost.Beast", "text/html",
+                                      "Not found\n"};
+    bench.run("static_response/template", [&](uint64_t n) {
+        for(uint64_t i = 0; i < n; ++i) {
+            const auto wire = not_found.wire(11, true, clock_cache().http_date());
+            do_not_optimize(net::buffer_size(wire.buffers()));
+        }
+    });
+}
+
+// Round trips of a 64 byte request/response over loopback TCP with each
+// socket profile. The request is written in two parts (header and body),
+// the pattern where Nagle's algorithm and delayed ACKs stall each other.
+void
+bench_socket_profiles(Bench &bench) {
+    for(const auto *name : {"kernel", "default", "latency", "throughput"}) {
+        const auto options = SocketOptions::profile(name);
+
+        bench.run(fmt::format("socket_round_trip/{}", name), [&](uint64_t n) {
+            net::io_context ioc;
+            tcp::acceptor acceptor {ioc};
+            tcp::socket client {ioc};
+
+            acceptor.open(tcp::v4());
+            acceptor.set_option(net::socket_base::reuse_address(true));
+            socket_options::apply_listener(acceptor, options);
+            acceptor.bind({net::ip::address_v4::loopback(), 0});
+            acceptor.listen();
+
+            client.open(tcp::v4());
+            socket_options::apply_upstream(client, options);
+
+            const auto server = [&]() -> net::awaitable<void> {
+                auto socket = co_await acceptor.async_accept(net::use_awaitable);
+                socket_options::apply_accepted(socket, options);
+
+                std::array<char, 64> buffer {};
+                for(uint64_t i = 0; i < n; ++i) {
+                    co_await net::async_read(socket, net::buffer(buffer), net::use_awaitable);
+                    co_await net::async_write(socket, net::buffer(buffer), net::use_awaitable);
+                }
+            };
+            const auto client_side = [&]() -> net::awaitable<void> {
+                co_await client.async_connect(acceptor.local_endpoint(), net::use_awaitable);
+
+                std::array<char, 64> buffer {};
+                for(uint64_t i = 0; i < n; ++i) {
+                    co_await net::async_write(client, net::buffer(buffer.data(), 16),
+                                              net::use_awaitable);
+                    co_await net::async_write(client, net::buffer(buffer.data() + 16, 48),
+                                              net::use_awaitable);
+                    co_await net::async_read(client, net::buffer(buffer), net::use_awaitable);
+                }
+            };
+
+            net::co_spawn(ioc, server(), net::detached);
+            net::co_spawn(ioc, client_side(), net::detached);
+            ioc.run();
+        });
+    }
+}
+
+int
+main(int argc, char **argv) {
+    // Keep stdout clean for the JSON report
+    spdlog::set_default_logger(spdlog::stderr_color_mt("proxy-bench"));
+
+    try {
+        const Options options {argc, argv};
+        Bench bench {options};
+        options.reject_unknown();
+
+        bench_url(bench);
+        bench_parse_batch(bench);
+        bench_result(bench);
+        bench_format(bench);
+        bench_response_parse(bench);
+        bench_routing(bench);
+        bench_clock(bench);
+        bench_static_response(bench);
+        bench_socket_profiles(bench);
+
+        bench.print_json();
+    } catch(const std::exception &e) {
+        logging::error("{}", e.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,251 @@
+#ifndef PROXY_CONTEXT_HH_
+#define PROXY_CONTEXT_HH_
+
+#include <charconv>
+#include <cstddef>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/asio/ip/tcp.hpp>
+
+#include "fetch_scheduler.hh"
+#include "log_setup.hh"
+#include "metrics.hh"
+#include "options.hh"
+#include "socket_options.hh"
+#include "upstream.hh"
+
+// websocket-proxy settings and the state its client sessions share
+namespace proxy {
+
+namespace net = boost::asio;
+using net::ip::tcp;
+
+// Runtime settings
+struct ProxyConfig {
+    // Port of the Prometheus metrics endpoint, 0 disables it
+    unsigned short metrics_port = 9082;
+
+    // Append per-stage fetch latency to every result sent to clients
+    bool stage_timings = false;
+
+    // Messages of a single websocket session processed concurrently
+    size_t session_max_inflight = 16;
+
+    // Client limits, 0 means unlimited. Connections over the limit are
+    // closed and messages over a limit get an Error(...) reply right away.
+    size_t max_connections_per_ip = 64;
+    size_t max_batch_size = 1000;
+    // URLs per second and message bytes per second of a session
+    double session_url_rate = 1000;
+    double session_byte_rate = 1 << 20;
+
+    // Upstream fetches in progress over all clients, 0 means unlimited.
+    // Clients share them in proportion to their weights.
+    size_t max_upstream_inflight = 256;
+    unsigned default_client_weight = 1;
+    // Weights by client IP address
+    std::map<std::string, unsigned> client_weights;
+
+    // Circuit breakers, concurrency limits and address choice
+    UpstreamConfig upstream;
+
+    // Reactor to run on: auto, epoll or io_uring
+    std::string io_backend = "auto";
+
+    // Applied to client and upstream sockets alike
+    SocketOptions sockets;
+
+    LogConfig log;
+
+    static ProxyConfig from_options(const Options &options) {
+        ProxyConfig config;
+        config.metrics_port = options.get("metrics-port", config.metrics_port);
+        config.stage_timings = options.get("stage-timings", config.stage_timings);
+        config.session_max_inflight =
+            options.get("session-max-inflight", config.session_max_inflight);
+        config.max_connections_per_ip =
+            options.get("max-connections-per-ip", config.max_connections_per_ip);
+        config.max_batch_size = options.get("max-batch-size", config.max_batch_size);
+        config.session_url_rate = options.get("session-url-rate", config.session_url_rate);
+        config.session_byte_rate = options.get("session-byte-rate", config.session_byte_rate);
+        config.max_upstream_inflight =
+            options.get("max-upstream-inflight", config.max_upstream_inflight);
+        config.default_client_weight =
+            options.get("default-client-weight", config.default_client_weight);
+        config.client_weights = parse_weights(options.get("client-weights", ""));
+        config.upstream = UpstreamConfig::from_options(options);
+        config.io_backend = options.get("io-backend", config.io_backend);
+        config.sockets = SocketOptions::from_options(options);
+        config.log = LogConfig::from_options(options);
+
+        if(config.session_max_inflight == 0) {
+            throw std::invalid_argument {"--session-max-inflight must be positive"};
+        }
+        if(config.default_client_weight == 0) {
+            throw std::invalid_argument {"--default-client-weight must be positive"};
+        }
+        return config;
+    }
+
+    unsigned client_weight(const tcp::endpoint &endpoint) const {
+        const auto it = client_weights.find(endpoint.address().to_string());
+        return it != client_weights.end() ? it->second : default_client_weight;
+    }
+
+    // Parse a list like "10.0.0.1:4,::1:2" into per-address weights
+    static std::map<std::string, unsigned> parse_weights(const std::string &list) {
+        std::map<std::string, unsigned> weights;
+        std::vector<std::string> items;
+
+        boost::split(items, list, boost::is_any_of(","), boost::token_compress_on);
+        for(const auto &item : items) {
+            if(item.empty()) {
+                continue;
+            }
+
+            const auto colon = item.rfind(':');
+            unsigned weight = 0;
+            const auto *last = item.data() + item.size();
+            if(colon == std::string::npos ||
+               std::from_chars(item.data() + colon + 1, last, weight).ptr != last ||
+               weight == 0) {
+                throw std::invalid_argument {
+                    "--client-weights: expected <address>:<positive weight>, got '" + item +
+                    "'"};
+            }
+            weights[item.substr(0, colon)] = weight;
+        }
+
+        return weights;
+    }
+};
+
+// Proxy metrics, registered on first use
+struct ProxyMetrics {
+    metrics::Histogram &batch_duration {metrics::registry().histogram(
+        "proxy_batch_duration_seconds", "Time to fetch all URLs of a websocket message")};
+    metrics::Histogram &fetch_duration {metrics::registry().histogram(
+        "proxy_fetch_duration_seconds", "Time to fetch a single URL")};
+    metrics::Histogram &fetch_queue_wait {metrics::registry().histogram(
+        "proxy_fetch_queue_wait_seconds",
+        "Time a URL fetch waits for upstream capacity before it starts")};
+    metrics::Histogram &resolve_duration {metrics::registry().histogram(
+        "proxy_fetch_stage_duration_seconds", "Time spent in each stage of a URL fetch",
+        {{"stage", "resolve"}})};
+    metrics::Histogram &connect_duration {metrics::registry().histogram(
+        "proxy_fetch_stage_duration_seconds", "Time spent in each stage of a URL fetch",
+        {{"stage", "connect"}})};
+    metrics::Histogram &write_duration {metrics::registry().histogram(
+        "proxy_fetch_stage_duration_seconds", "Time spent in each stage of a URL fetch",
+        {{"stage", "write"}})};
+    metrics::Histogram &read_duration {metrics::registry().histogram(
+        "proxy_fetch_stage_duration_seconds", "Time spent in each stage of a URL fetch",
+        {{"stage", "read"}})};
+    metrics::Counter &fetches_ok {metrics::registry().counter(
+        "proxy_fetches_total", "Completed URL fetches", {{"result", "ok"}})};
+    metrics::Counter &fetches_err {metrics::registry().counter(
+        "proxy_fetches_total", "Completed URL fetches", {{"result", "error"}})};
+    metrics::Gauge &queued_urls {metrics::registry().gauge(
+        "proxy_queued_urls", "URLs received from clients and not answered yet")};
+    metrics::Gauge &inflight_fetches {
+        metrics::registry().gauge("proxy_inflight_fetches", "Upstream fetches in progress")};
+    metrics::Gauge &active_sessions {
+        metrics::registry().gauge("proxy_active_sessions", "Connected websocket clients")};
+    metrics::Counter &rejected_connections {metrics::registry().counter(
+        "proxy_rejected_total", "Connections and messages refused by client limits",
+        {{"reason", "connections"}})};
+    metrics::Counter &rejected_batch_size {metrics::registry().counter(
+        "proxy_rejected_total", "Connections and messages refused by client limits",
+        {{"reason", "batch_size"}})};
+    metrics::Counter &rejected_url_rate {metrics::registry().counter(
+        "proxy_rejected_total", "Connections and messages refused by client limits",
+        {{"reason", "url_rate"}})};
+    metrics::Counter &rejected_byte_rate {metrics::registry().counter(
+        "proxy_rejected_total", "Connections and messages refused by client limits",
+        {{"reason", "byte_rate"}})};
+    metrics::Counter &ws_bytes_in {metrics::registry().counter(
+        "proxy_websocket_received_bytes_total", "Bytes received from websocket clients")};
+    metrics::Counter &ws_bytes_out {metrics::registry().counter(
+        "proxy_websocket_sent_bytes_total", "Bytes sent to websocket clients")};
+    metrics::Counter &upstream_bytes_in {metrics::registry().counter(
+        "proxy_upstream_received_bytes_total", "Bytes received from upstream servers")};
+    metrics::Counter &upstream_bytes_out {metrics::registry().counter(
+        "proxy_upstream_sent_bytes_total", "Bytes sent to upstream servers")};
+};
+
+inline ProxyMetrics &
+proxy_metrics() {
+    static ProxyMetrics instance;
+    return instance;
+}
+
+// Open connections per client address. Not thread safe.
+class ConnectionTracker {
+public:
+    // A counted connection, uncounted on destruction
+    class Slot {
+    public:
+        Slot(ConnectionTracker *tracker, const net::ip::address &address):
+            m_tracker {tracker}, m_address {address} {}
+        Slot(Slot &&other) noexcept:
+            m_tracker {std::exchange(other.m_tracker, nullptr)}, m_address {other.m_address} {}
+        Slot &operator=(Slot &&) = delete;
+        ~Slot() {
+            if(m_tracker) {
+                m_tracker->remove(m_address);
+            }
+        }
+
+    private:
+        ConnectionTracker *m_tracker;
+        net::ip::address m_address;
+    };
+
+    // `limit` connections per address, 0 means unlimited
+    explicit ConnectionTracker(size_t limit): m_limit {limit} {}
+
+    // Count a new connection from `address`, or return nothing if the
+    // address is at its limit
+    std::optional<Slot> add(const net::ip::address &address) {
+        auto &count = m_counts[address];
+        if(m_limit > 0 && count >= m_limit) {
+            return std::nullopt;
+        }
+        ++count;
+        return Slot {this, address};
+    }
+
+private:
+    void remove(const net::ip::address &address) {
+        if(const auto it = m_counts.find(address); it != m_counts.end() && --it->second == 0) {
+            m_counts.erase(it);
+        }
+    }
+
+    const size_t m_limit;
+    std::map<net::ip::address, size_t> m_counts;
+};
+
+// State shared by all client sessions
+struct ProxyContext {
+    explicit ProxyContext(const ProxyConfig &config_):
+        config {config_},
+        connections {config.max_connections_per_ip},
+        scheduler {config.max_upstream_inflight},
+        upstreams {config.upstream} {}
+
+    const ProxyConfig &config;
+    ConnectionTracker connections;
+    FetchScheduler scheduler;
+    UpstreamRegistry upstreams;
+};
+
+} // namespace proxy
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef PROXY_ERROR_HH_
+#define PROXY_ERROR_HH_
+
+#include <string>
+#include <type_traits>
+
+#include <boost/system/error_code.hpp>
+
+// Errors raised by the proxy itself rather than by the network or the
+// upstream server
+enum class proxy_errc {
+    // The circuit breaker of the upstream is open
+    circuit_open = 1,
+    // No room for the state of another upstream
+    too_many_upstreams,
+};
+
+namespace boost::system {
+template <>
+struct is_error_code_enum<proxy_errc>: std::true_type {};
+} // namespace boost::system
+
+namespace proxy_error {
+
+class category_impl: public boost::system::error_category {
+public:
+    const char *name() const noexcept override {
+        return "proxy";
+    }
+
+    std::string message(int ev) const override {
+        switch(static_cast<proxy_errc>(ev)) {
+        case proxy_errc::circuit_open:
+            return "circuit breaker open";
+        case proxy_errc::too_many_upstreams:
+            return "too many upstreams in use";
+        }
+        return "unknown proxy error";
+    }
+};
+
+inline const boost::system::error_category &
+category() {
+    static const category_impl instance;
+    return instance;
+}
+
+} // namespace proxy_error
+
+inline boost::system::error_code
+make_error_code(proxy_errc e) {
+    return {static_cast<int>(e), proxy_error::category()};
+}
+
+#endif
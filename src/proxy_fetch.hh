@@ -0,0 +1,326 @@
+#ifndef PROXY_FETCH_HH_
+#define PROXY_FETCH_HH_
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/version.hpp>
+
+#include "CxxUrl/url.hpp"
+
+#include "spdlog/spdlog.h"
+
+#include "cancellation.hh"
+#include "happy_eyeballs.hh"
+#include "log_setup.hh"
+#include "my_result.hh"
+#include "proxy_context.hh"
+#include "proxy_error.hh"
+#include "proxy_protocol.hh"
+#include "socket_options.hh"
+
+// Upstream HTTP fetches of websocket-proxy
+namespace proxy {
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+namespace this_coro = boost::asio::this_coro;
+namespace logging = spdlog;
+
+using namespace std::string_literals;
+using boost::system::error_code;
+using net::ip::tcp;
+
+inline net::awaitable<StringResult<std::string>>
+http_get(ProxyContext &ctx, std::shared_ptr<FetchScheduler::Flow> flow,
+         const std::string url_string, FetchTimings &timings) {
+    const int version = 11;
+    beast::error_code ec;
+    std::optional<metrics::ScopedGauge> inflight;
+
+    // Each stage is timed from the end of the previous one. If a stage
+    // throws, the time until the failure is charged to it.
+    auto stage_start = std::chrono::steady_clock::now();
+    FetchTimings::duration *stage = nullptr;
+    const auto end_stage = [&](FetchTimings::duration *next) {
+        const auto now = std::chrono::steady_clock::now();
+        *stage += now - stage_start;
+        stage_start = now;
+        stage = next;
+    };
+
+    // These objects perform our I/O
+    tcp::resolver resolver(co_await this_coro::executor);
+    beast::tcp_stream stream(co_await this_coro::executor);
+
+    // Capacity held by the fetch, and the reporting of its outcome to the
+    // upstream's circuit breaker, concurrency limiter and balancer. The
+    // upstream outlives the rest.
+    std::shared_ptr<Upstream> upstream;
+    std::optional<CircuitBreaker::Admission> admission;
+    AdaptiveLimiter::Token token {nullptr};
+    FetchScheduler::Permit permit;
+    EndpointBalancer::Lease lease {nullptr, nullptr};
+    auto started = std::chrono::steady_clock::now();
+    // Let the fetch past the upstream's circuit breaker, false while open
+    const auto admit = [&] {
+        admission = upstream->breaker.admit();
+        if(!admission) {
+            upstream->rejected.inc();
+        }
+        return admission.has_value();
+    };
+    const auto circuit_open = [&] {
+        return upstream->name + ": " + make_error_code(proxy_errc::circuit_open).message();
+    };
+    const auto report = [&](bool ok) {
+        if(ok) {
+            const auto latency = std::chrono::steady_clock::now() - started;
+            admission->success();
+            token.success(latency);
+            lease.success(latency);
+        } else {
+            admission->failure();
+            token.failure();
+            lease.failure();
+        }
+        upstream->concurrency_limit.set(static_cast<int64_t>(upstream->limiter.limit()));
+    };
+
+    try {
+        Url url {url_string};
+        auto host = url.host();
+        auto port = url.port();
+        auto target = url.path();
+        auto scheme = url.scheme();
+
+        if(scheme != "http") {
+            co_return Err {"scheme not supported: '"s + scheme + "'"s};
+        }
+
+        if(host.empty()) {
+            co_return Err {"empty host not allowed"s};
+        }
+
+        if(port.empty()) {
+            port = "80";
+        }
+
+        if(target.empty()) {
+            target = "/";
+        }
+
+        // Fail fast while the circuit of a known upstream is open
+        upstream = ctx.upstreams.find(host, port);
+        if(upstream && !admit()) {
+            co_return Err {circuit_open()};
+        }
+
+        // An unknown upstream gets its entry once its name resolves, and
+        // goes through the same checks then, before the fetch waits for
+        // anything: a fetch never waits while holding capacity.
+        std::optional<tcp::resolver::results_type> results;
+        stage_start = std::chrono::steady_clock::now();
+        if(upstream) {
+            stage = &timings.queue;
+        } else {
+            stage = &timings.resolve;
+            results = co_await resolver.async_resolve(host, port, net::use_awaitable);
+            end_stage(&timings.queue);
+            upstream = ctx.upstreams.get(host, port);
+            if(!upstream) {
+                co_return Err {fmt::format(
+                    "{}:{}: {}", host, port,
+                    make_error_code(proxy_errc::too_many_upstreams).message())};
+            }
+            if(!admit()) {
+                co_return Err {circuit_open()};
+            }
+        }
+
+        // Wait for room under the upstream's concurrency limit, then for
+        // this client's turn. Latency samples start once both are held.
+        token = co_await upstream->limiter.acquire(flow.get(), flow->weight());
+        permit = co_await flow->acquire();
+        inflight.emplace(proxy_metrics().inflight_fetches);
+        end_stage(results ? &timings.connect : &timings.resolve);
+        started = stage_start;
+
+        // Look up the domain name. Lookups don't support cancellation, a
+        // cancelled fetch stops at the next co_await once this completes.
+        if(!results) {
+            results = co_await resolver.async_resolve(host, port, net::use_awaitable);
+            end_stage(&timings.connect);
+        }
+
+        // Make the connection on the IP address we get from a lookup,
+        // racing the resolved endpoints with the balancer's pick first.
+        // Attempts may report after this coroutine is gone, so they hold on
+        // to the upstream. The callbacks are named: GCC 12 destroys lambda
+        // temporaries of a co_await expression twice.
+        const auto setup_socket = [&](tcp::socket &socket) {
+            socket_options::apply_upstream(socket, ctx.config.sockets);
+        };
+        const auto report_connect = [upstream](const tcp::endpoint &ep, error_code ec) {
+            upstream->balancer.report_connect(ep, ec);
+        };
+        const auto endpoint = co_await happy_eyeballs::async_connect(
+            stream.socket(), upstream->balancer.order(happy_eyeballs::endpoints_of(*results)),
+            std::chrono::seconds(30), setup_socket, report_connect);
+        lease = upstream->balancer.lease(endpoint);
+        end_stage(&timings.write);
+
+        // Set up an HTTP GET request message
+        http::request<http::string_body> req {http::verb::get, target, version};
+        req.set(http::field::host, host);
+        req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+
+        // Set the timeout.
+        stream.expires_after(std::chrono::seconds(30));
+
+        // Send the HTTP request to the remote host
+        proxy_metrics().upstream_bytes_out.inc(
+            co_await http::async_write(stream, req, net::use_awaitable));
+        end_stage(&timings.read);
+
+        // This buffer is used for reading and must be persisted
+        beast::flat_buffer b;
+
+        // Declare a container to hold the response
+        http::response<http::dynamic_body> res;
+
+        // Receive the HTTP response
+        proxy_metrics().upstream_bytes_in.inc(
+            co_await http::async_read(stream, b, res, net::use_awaitable));
+        end_stage(nullptr);
+
+        // Client errors are not the upstream's fault
+        report(res.result_int() < 500);
+
+        // Write the message to standard out
+        // std::cout << res << std::endl;
+
+        // Gracefully close the socket
+        stream.socket().shutdown(tcp::socket::shutdown_both, ec);
+
+        if(res.result() != http::status::ok) {
+            const auto message = fmt::format("got http status {}", res.result_int());
+            logging::warn(message);
+            co_return Err {message};
+        }
+
+        if(res.body().size() == 0) {
+            const auto message = fmt::format("got http empty body");
+            logging::warn(message);
+            co_return Err {message};
+        }
+
+        co_return Ok {beast::buffers_to_string(res.body().data())};
+    } catch(const std::exception &e) {
+        if(stage) {
+            end_stage(nullptr);
+        }
+        // Cancellation says nothing about the upstream
+        const auto *error = dynamic_cast<const boost::system::system_error *>(&e);
+        if(admission && (!error || error->code() != net::error::operation_aborted)) {
+            report(false);
+        }
+        logging::error("http_get got exception: {}", e.what());
+        co_return Err {std::string {e.what()}};
+    }
+}
+
+inline net::awaitable<void>
+http_get_wrapper(ProxyContext &ctx, std::shared_ptr<FetchScheduler::Flow> flow,
+                 const std::string url_string, std::shared_ptr<result_channel> chan) {
+    const auto start = std::chrono::steady_clock::now();
+    FetchResult r;
+    r.result = co_await http_get(ctx, flow, url_string, r.timings);
+
+    auto &m = proxy_metrics();
+    m.fetch_queue_wait.observe(r.timings.queue);
+    m.fetch_duration.observe(std::chrono::steady_clock::now() - start - r.timings.queue);
+    (r.result.is_ok() ? m.fetches_ok : m.fetches_err).inc();
+
+    const auto observe_stage = [](metrics::Histogram &h, FetchTimings::duration d) {
+        if(d > FetchTimings::duration::zero()) {
+            h.observe(d);
+        }
+    };
+    observe_stage(m.resolve_duration, r.timings.resolve);
+    observe_stage(m.connect_duration, r.timings.connect);
+    observe_stage(m.write_duration, r.timings.write);
+    observe_stage(m.read_duration, r.timings.read);
+
+    // The channel has room for every result of the batch, so this never
+    // waits, even if the batch has been abandoned
+    chan->try_send(error_code {}, r);
+}
+
+inline net::awaitable<std::vector<FetchResult>>
+http_get_multiple(ProxyContext &ctx, std::shared_ptr<FetchScheduler::Flow> flow,
+                  const std::vector<std::string> urls) {
+    const auto N = urls.size();
+    const auto start = std::chrono::steady_clock::now();
+    auto ioc = co_await this_coro::executor;
+    auto &m = proxy_metrics();
+
+    m.queued_urls.inc(N);
+
+    auto chan = std::make_shared<result_channel>(ioc, N);
+    std::vector<FetchResult> results;
+    CancellationGroup fetches;
+
+    // If this coroutine is cancelled (the client is gone), cancel the
+    // fetches that are still running as well
+    struct cancel_guard {
+        ~cancel_guard() {
+            fetches.emit();
+            m.queued_urls.dec(N - results.size());
+        }
+        CancellationGroup &fetches;
+        ProxyMetrics &m;
+        const size_t N;
+        const std::vector<FetchResult> &results;
+    } guard {fetches, m, N, results};
+
+    for(const auto &url : urls) {
+        SPDLOG_INFO("HTTP requesting '{}'", url);
+        net::co_spawn(ioc, http_get_wrapper(ctx, flow, url, chan), fetches.token());
+    }
+
+    // TODO: order
+    for(size_t i = 0; i < N; ++i) {
+        const auto fr = co_await chan->async_receive(net::use_awaitable);
+        const auto &r = fr.result;
+        if(r.is_ok()) {
+            SPDLOG_INFO("HTTP got reply '{}'", log_setup::truncated(*r.ok()));
+        } else {
+            SPDLOG_ERROR("HTTP got error '{}'", *r.err());
+        }
+
+        results.push_back(fr);
+        m.queued_urls.dec();
+    }
+
+    m.batch_duration.observe(std::chrono::steady_clock::now() - start);
+    co_return results;
+}
+
+} // namespace proxy
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef PROXY_PROTOCOL_HH_
+#define PROXY_PROTOCOL_HH_
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/asio/experimental/channel.hpp>
+
+#include "spdlog/fmt/fmt.h"
+
+#include "my_result.hh"
+
+// Types and text encoding shared by websocket-proxy and its benchmarks
+
+template <typename T>
+using StringResult = Result<T, std::string>;
+
+// Time spent in each stage of an upstream fetch. Stages that have not
+// been reached are zero; a failed stage holds the time until the failure.
+struct FetchTimings {
+    using duration = std::chrono::steady_clock::duration;
+
+    duration queue {};
+    duration resolve {};
+    duration connect {};
+    duration write {};
+    duration read {};
+};
+
+// Result of a single URL fetch along with its latency breakdown
+struct FetchResult {
+    StringResult<std::string> result;
+    FetchTimings timings;
+};
+
+using result_channel =
+    boost::asio::experimental::channel<void(boost::system::error_code, FetchResult)>;
+
+// A client message: URLs to fetch, tagged with the id the reply will carry
+struct Batch {
+    std::string id;
+    std::vector<std::string> urls;
+};
+
+// Split a client message into URLs
+inline std::vector<std::string>
+parse_batch(std::string line) {
+    std::vector<std::string> urls;
+
+    boost::trim(line);
+    boost::split(urls, line, boost::is_any_of("\t\r\n "), boost::token_compress_on);
+    return urls;
+}
+
+// Parse a client message. A leading `#<id>` token sets the message id,
+// otherwise the message gets its sequence number within the session.
+inline Batch
+parse_message(std::string line, uint64_t seq) {
+    Batch batch {std::to_string(seq), parse_batch(std::move(line))};
+
+    if(!batch.urls.empty() && batch.urls.front().starts_with('#')) {
+        batch.id = batch.urls.front().substr(1);
+        batch.urls.erase(batch.urls.begin());
+    }
+    return batch;
+}
+
+// Format a latency breakdown like "queue=0.010ms resolve=0.120ms ..."
+inline std::string
+format_timings(const FetchTimings &t) {
+    const auto ms = [](FetchTimings::duration d) {
+        return std::chrono::duration<double, std::milli>(d).count();
+    };
+    return fmt::format(
+        "queue={:.3f}ms resolve={:.3f}ms connect={:.3f}ms write={:.3f}ms read={:.3f}ms",
+        ms(t.queue), ms(t.resolve), ms(t.connect), ms(t.write), ms(t.read));
+}
+
+// Build the reply to a client message, one Ok(...) or Err(...) line per URL
+inline std::string
+format_results(const std::vector<FetchResult> &results, bool stage_timings) {
+    std::string result_string;
+
+    for(const auto &[r, timings] : results) {
+        if(r.is_ok()) {
+            result_string += "Ok(" + *r.ok() + ")";
+        } else {
+            result_string += "Err(" + *r.err() + ")";
+        }
+
+        if(stage_timings) {
+            result_string += " [" + format_timings(timings) + "]";
+        }
+        result_string += "\n";
+    }
+
+    return result_string;
+}
+
+// Build the reply to a client message: the `#<id>` line followed by the
+// results
+inline std::string
+format_reply(const std::string &id, const std::vector<FetchResult> &results,
+             bool stage_timings) {
+    return "#" + id + "\n" + format_results(results, stage_timings);
+}
+
+// Build the reply to a client message that has been refused as a whole
+inline std::string
+format_error(const std::string &id, const std::string &reason) {
+    return "#" + id + "\nError(" + reason + ")\n";
+}
+
+#endif
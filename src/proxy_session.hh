@@ -0,0 +1,381 @@
+#ifndef PROXY_SESSION_HH_
+#define PROXY_SESSION_HH_
+
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <poll.h>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/experimental/channel.hpp>
+#include <boost/asio/experimental/channel_error.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/version.hpp>
+#include <boost/beast/websocket.hpp>
+
+#include "spdlog/fmt/ostr.h"
+#include "spdlog/spdlog.h"
+
+#include "cancellation.hh"
+#include "metrics.hh"
+#include "proxy_context.hh"
+#include "proxy_fetch.hh"
+#include "proxy_protocol.hh"
+#include "socket_options.hh"
+#include "token_bucket.hh"
+
+// websocket client sessions of websocket-proxy
+namespace proxy {
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+namespace this_coro = boost::asio::this_coro;
+namespace websocket = beast::websocket;
+namespace logging = spdlog;
+
+using boost::system::error_code;
+using net::experimental::channel;
+using net::ip::tcp;
+
+// A reply waiting in the session outbox
+struct Reply {
+    bool text;
+    std::string payload;
+};
+
+using reply_channel = channel<void(error_code, Reply)>;
+
+// State of a websocket client session, shared by its reader, its writer and
+// the coroutines processing its messages
+struct WsSession {
+    WsSession(const ProxyConfig &config, websocket::stream<beast::tcp_stream> ws_,
+              ConnectionTracker::Slot connection_,
+              std::shared_ptr<FetchScheduler::Flow> flow_):
+        ws {std::move(ws_)},
+        connection {std::move(connection_)},
+        outbox {ws.get_executor(), config.session_max_inflight},
+        slots {ws.get_executor(), config.session_max_inflight},
+        flow {std::move(flow_)},
+        url_bucket {config.session_url_rate,
+                    std::max(config.session_url_rate, double(config.max_batch_size))},
+        byte_bucket {config.session_byte_rate, config.session_byte_rate} {}
+
+    websocket::stream<beast::tcp_stream> ws;
+    ConnectionTracker::Slot connection;
+    // Replies in completion order, written by a single writer
+    reply_channel outbox;
+    // Counting semaphore: one buffered element per message being processed
+    channel<void(error_code)> slots;
+    // Share of the upstream fetches
+    std::shared_ptr<FetchScheduler::Flow> flow;
+    // Rate limits on URLs and message bytes
+    TokenBucket url_bucket;
+    TokenBucket byte_bucket;
+    // Coroutines processing messages, cancelled when the client goes away
+    CancellationGroup inflight;
+    metrics::ScopedGauge gauge {proxy_metrics().active_sessions};
+};
+
+// Apply the session's limits to a message. Returns why the message is
+// refused, or an empty string if it may go on.
+inline std::string
+check_limits(const ProxyConfig &config, WsSession &session, const Batch &batch,
+             size_t size) {
+    auto &m = proxy_metrics();
+
+    if(config.max_batch_size > 0 && batch.urls.size() > config.max_batch_size) {
+        m.rejected_batch_size.inc();
+        return fmt::format("batch too large: {} URLs, at most {} allowed", batch.urls.size(),
+                           config.max_batch_size);
+    }
+    // A refused message takes nothing from either bucket
+    if(!session.byte_bucket.can_consume(size)) {
+        m.rejected_byte_rate.inc();
+        return fmt::format("rate limited: more than {} bytes/s", config.session_byte_rate);
+    }
+    if(!session.url_bucket.can_consume(batch.urls.size())) {
+        m.rejected_url_rate.inc();
+        return fmt::format("rate limited: more than {} URLs/s", config.session_url_rate);
+    }
+    session.byte_bucket.consume(size);
+    session.url_bucket.consume(batch.urls.size());
+    return {};
+}
+
+// Fetch the URLs of a single client message and queue the reply
+inline net::awaitable<void>
+websocket_process(ProxyContext &ctx, std::shared_ptr<WsSession> session, Batch batch,
+                  bool text) {
+    try {
+        const auto result = co_await http_get_multiple(ctx, session->flow, batch.urls);
+        // Named: GCC 12 destroys aggregate temporaries of a co_await
+        // expression twice
+        Reply reply {text, format_reply(batch.id, result, ctx.config.stage_timings)};
+        co_await session->outbox.async_send(error_code {}, std::move(reply),
+                                            net::use_awaitable);
+    } catch(const std::exception &e) {
+        // The outbox is closed once the client is gone
+        SPDLOG_DEBUG("dropping reply to message {}: {}", batch.id, e.what());
+    }
+
+    // Release the slot
+    session->slots.try_receive([](error_code) {});
+}
+
+// Write queued replies until the session ends
+inline net::awaitable<void>
+websocket_writer(std::shared_ptr<WsSession> session) {
+    try {
+        for(;;) {
+            auto reply = co_await session->outbox.async_receive(net::use_awaitable);
+
+            session->ws.text(reply.text);
+            proxy_metrics().ws_bytes_out.inc(co_await session->ws.async_write(
+                net::buffer(reply.payload), net::use_awaitable));
+        }
+    } catch(const std::exception &e) {
+        SPDLOG_DEBUG("websocket writer stopped: {}", e.what());
+    }
+
+    // Make the reader fail as well if writing did
+    error_code ec;
+    session->outbox.close();
+    beast::get_lowest_layer(session->ws).socket().close(ec);
+}
+
+// Watches a client connection that is not being read, and calls `gone`
+// as soon as the client resets it or ends its stream. A message arriving
+// first is left to the reader; behind it only a reset can be seen. The
+// socket's pending operations are not cancelled when the watch ends, as
+// the writer may be using it: its waits end with the next event on the
+// socket instead.
+class ClosureWatch {
+public:
+    ClosureWatch(tcp::socket &socket, std::function<void()> gone):
+        m_state {std::make_shared<State>(std::move(gone))} {
+        socket.async_wait(tcp::socket::wait_read, [state = m_state, &socket](error_code ec) {
+            if(ec || state->done) {
+                return;
+            }
+            if(peer_closed(socket)) {
+                state->notify();
+                return;
+            }
+            // A message: errors are still reported, end of stream isn't
+            socket.async_wait(tcp::socket::wait_error, [state](error_code ec) {
+                if(!ec && !state->done) {
+                    state->notify();
+                }
+            });
+        });
+    }
+
+    ClosureWatch(const ClosureWatch &) = delete;
+    ClosureWatch &operator=(const ClosureWatch &) = delete;
+
+    ~ClosureWatch() {
+        m_state->done = true;
+    }
+
+private:
+    // Outlives the watch until its waits complete
+    struct State {
+        explicit State(std::function<void()> gone_): gone {std::move(gone_)} {}
+
+        void notify() {
+            done = true;
+            gone();
+        }
+
+        std::function<void()> gone;
+        bool done = false;
+    };
+
+    // Whether the peer has shut down or reset the connection, whether or
+    // not data is left to read
+    static bool peer_closed(tcp::socket &socket) {
+        pollfd fd {socket.native_handle(), POLLRDHUP, 0};
+        return ::poll(&fd, 1, 0) > 0 && (fd.revents & (POLLRDHUP | POLLHUP | POLLERR)) != 0;
+    }
+
+    std::shared_ptr<State> m_state;
+};
+
+// websocket client session. Messages are processed concurrently, up to
+// `session_max_inflight` at a time; the reader stops reading while that many
+// are in progress, and watches the connection instead.
+inline net::awaitable<void>
+websocket_client(ProxyContext &ctx, ConnectionTracker::Slot connection,
+                 websocket::stream<beast::tcp_stream> ws) {
+    auto ioc = co_await this_coro::executor;
+    error_code ec;
+    const auto peer = beast::get_lowest_layer(ws).socket().remote_endpoint(ec);
+    const auto weight = ctx.config.client_weight(peer);
+    auto session = std::make_shared<WsSession>(
+        ctx.config, std::move(ws), std::move(connection), ctx.scheduler.flow(weight));
+    auto &stream = session->ws;
+
+    // Set suggested timeout settings for the websocket
+    stream.set_option(websocket::stream_base::timeout::suggested(beast::role_type::server));
+
+    // Set a decorator to change the Server of the handshake
+    stream.set_option(websocket::stream_base::decorator([](websocket::response_type &res) {
+        res.set(http::field::server,
+                std::string(BOOST_BEAST_VERSION_STRING) + " websocket-server-coro");
+    }));
+
+    try {
+        // Accept the websocket handshake
+        co_await stream.async_accept(net::use_awaitable);
+
+        net::co_spawn(ioc, websocket_writer(session), net::detached);
+
+        for(uint64_t seq = 1;; ++seq) {
+            // This buffer will hold the incoming message
+            beast::flat_buffer buffer;
+
+            // Read a message
+            const auto size = co_await stream.async_read(buffer, net::use_awaitable);
+            proxy_metrics().ws_bytes_in.inc(size);
+            auto batch = parse_message(beast::buffers_to_string(buffer.data()), seq);
+
+            // Refuse messages over a limit right away instead of queueing them
+            auto reason = check_limits(ctx.config, *session, batch, size);
+            if(!reason.empty()) {
+                SPDLOG_WARN("refusing message {} from {}: {}", batch.id, peer, reason);
+                Reply refusal {stream.got_text(), format_error(batch.id, reason)};
+                co_await session->outbox.async_send(error_code {}, std::move(refusal),
+                                                    net::use_awaitable);
+                continue;
+            }
+
+            // Wait for a free slot, then process the message in the background.
+            // A client that goes away meanwhile cancels its fetches right away
+            // rather than once one of them ends.
+            if(!session->slots.try_send(error_code {})) {
+                const ClosureWatch watch {
+                    beast::get_lowest_layer(stream).socket(),
+                    [weak = std::weak_ptr {session}] {
+                        if(const auto session = weak.lock()) {
+                            session->inflight.emit();
+                            session->slots.cancel();
+                        }
+                    }};
+                co_await session->slots.async_send(error_code {}, net::use_awaitable);
+            }
+            net::co_spawn(ioc,
+                          websocket_process(ctx, session, std::move(batch), stream.got_text()),
+                          session->inflight.token());
+        }
+    } catch(const boost::system::system_error &e) {
+        // The closure watch cancels the wait for a slot
+        if(const auto ec = e.code(); ec != websocket::error::closed &&
+                                     ec != net::experimental::error::channel_cancelled) {
+            logging::error("websocket_client got exception: {}", ec);
+        } else {
+            logging::info("websocket client disconnected");
+        }
+    } catch(const std::exception &e) {
+        logging::error("websocket_client got exception {}", e.what());
+    }
+
+    // Abort outstanding fetches and stop the writer
+    session->inflight.emit();
+    session->outbox.close();
+}
+
+// Turn away a client over its connection limit. The handshake is
+// completed, so that the client gets an explicit close reason.
+inline net::awaitable<void>
+websocket_reject(websocket::stream<beast::tcp_stream> ws, std::string reason) {
+    try {
+        ws.set_option(websocket::stream_base::timeout::suggested(beast::role_type::server));
+        co_await ws.async_accept(net::use_awaitable);
+        co_await ws.async_close({websocket::close_code::try_again_later, reason},
+                                net::use_awaitable);
+    } catch(const std::exception &e) {
+        SPDLOG_DEBUG("websocket_reject got exception {}", e.what());
+    }
+}
+
+// Accepts incoming connections and launches the sessions
+inline net::awaitable<void>
+websocket_listen(ProxyContext &ctx, tcp::endpoint endpoint) {
+    auto ioc = co_await this_coro::executor;
+    beast::error_code ec;
+
+    // Open the acceptor
+    tcp::acceptor acceptor(ioc);
+    acceptor.open(endpoint.protocol(), ec);
+    if(ec) {
+        logging::error("open: {}", ec.what());
+        co_return;
+    }
+
+    // Allow address reuse
+    acceptor.set_option(net::socket_base::reuse_address(true), ec);
+    if(ec) {
+        logging::error("set_options: {}", ec.what());
+        co_return;
+    }
+
+    socket_options::apply_listener(acceptor, ctx.config.sockets);
+
+    // Bind to the server address
+    acceptor.bind(endpoint, ec);
+    if(ec) {
+        logging::error("bind: {}", ec.what());
+        co_return;
+    }
+
+    // Start listening for connections
+    acceptor.listen(net::socket_base::max_listen_connections, ec);
+    if(ec) {
+        logging::error("listen {}", ec.what());
+        co_return;
+    }
+
+    logging::info("listening on ws://{}", endpoint);
+    for(;;) {
+        tcp::socket socket(ioc);
+        co_await acceptor.async_accept(socket, net::use_awaitable);
+        const auto peer = socket.remote_endpoint(ec);
+        if(ec) {
+            continue;
+        }
+        SPDLOG_INFO("websocket client connected from {}", peer);
+        socket_options::apply_accepted(socket, ctx.config.sockets);
+
+        websocket::stream<beast::tcp_stream> ws {std::move(socket)};
+        auto connection = ctx.connections.add(peer.address());
+        if(!connection) {
+            proxy_metrics().rejected_connections.inc();
+            SPDLOG_WARN("refusing connection from {}: too many connections", peer);
+            net::co_spawn(ioc,
+                          websocket_reject(std::move(ws),
+                                           "too many connections from your address"),
+                          net::detached);
+            continue;
+        }
+
+        net::co_spawn(ioc, websocket_client(ctx, std::move(*connection), std::move(ws)),
+                      net::detached);
+    }
+}
+
+} // namespace proxy
+
+#endif
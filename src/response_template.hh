@@ -0,0 +1,105 @@
+#ifndef RESPONSE_TEMPLATE_HH_
+#define RESPONSE_TEMPLATE_HH_
+
+#include <array>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/beast/http/status.hpp>
+
+#include "spdlog/fmt/fmt.h"
+
+// HTTP response with a fixed status line and headers, serialized once.
+// Only the headers that change from one response to the next (Date,
+// Connection, Content-Length and any extra ones) are formatted when it is
+// sent, and the whole response goes out in a single gather write of the
+// serialized head, those headers and the body. Responses with a fixed body
+// keep it in the template too.
+class ResponseTemplate {
+public:
+    // A response ready to write, valid while the template, the date, the
+    // extra headers and the body it was made from are
+    class Wire {
+    public:
+        std::array<boost::asio::const_buffer, 3> buffers() const {
+            const auto headers = m_overflow.empty()
+                                     ? boost::asio::buffer(m_headers.data(), m_headers_size)
+                                     : boost::asio::buffer(m_overflow);
+            return {boost::asio::buffer(m_head), headers,
+                    boost::asio::buffer(m_body.data(), m_body.size())};
+        }
+
+        // Send only the first `size` bytes of the body, keeping the
+        // announced Content-Length
+        void truncate_body(size_t size) {
+            m_body = m_body.substr(0, size);
+        }
+
+    private:
+        friend class ResponseTemplate;
+
+        std::string_view m_head;
+        std::array<char, 256> m_headers;
+        size_t m_headers_size = 0;
+        // Headers too long for m_headers
+        std::string m_overflow;
+        std::string_view m_body;
+    };
+
+    ResponseTemplate(boost::beast::http::status status, std::string_view server,
+                     std::string_view content_type, std::string body = {}):
+        m_status {status},
+        m_head10 {head(10, status, server, content_type)},
+        m_head11 {head(11, status, server, content_type)},
+        m_body {std::move(body)} {}
+
+    boost::beast::http::status status() const {
+        return m_status;
+    }
+
+    // Response with the template's own body
+    Wire wire(unsigned version, bool keep_alive, std::string_view date,
+              std::string_view extra_headers = {}) const {
+        return with_body(version, keep_alive, date, m_body, extra_headers);
+    }
+
+    // Response with `body`. `extra_headers` are complete header lines,
+    // each ending with CRLF.
+    Wire with_body(unsigned version, bool keep_alive, std::string_view date,
+                   std::string_view body, std::string_view extra_headers = {}) const {
+        Wire w;
+        w.m_head = version == 10 ? m_head10 : m_head11;
+        w.m_body = body;
+        constexpr std::string_view format =
+            "Date: {}\r\nConnection: {}\r\n{}Content-Length: {}\r\n\r\n";
+        const auto connection = keep_alive ? "keep-alive" : "close";
+        const auto result = fmt::format_to_n(w.m_headers.data(), w.m_headers.size(), format,
+                                             date, connection, extra_headers, body.size());
+        if(result.size > w.m_headers.size()) {
+            w.m_overflow =
+                fmt::format(format, date, connection, extra_headers, body.size());
+        } else {
+            w.m_headers_size = result.size;
+        }
+        return w;
+    }
+
+private:
+    static std::string head(unsigned version, boost::beast::http::status status,
+                            std::string_view server, std::string_view content_type) {
+        const auto reason = boost::beast::http::obsolete_reason(status);
+        return fmt::format("HTTP/{}.{} {} {}\r\nServer: {}\r\nContent-Type: {}\r\n",
+                           version / 10, version % 10, static_cast<unsigned>(status),
+                           std::string_view {reason.data(), reason.size()}, server,
+                           content_type);
+    }
+
+    const boost::beast::http::status m_status;
+    const std::string m_head10;
+    const std::string m_head11;
+    const std::string m_body;
+};
+
+#endif
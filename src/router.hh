@@ -0,0 +1,176 @@
+#ifndef ROUTER_HH_
+#define ROUTER_HH_
+
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+// Request target router. Routes are patterns of '/'-separated segments,
+// each either a literal or a `{number}` parameter (decimal digits with an
+// optional fraction, e.g. "2" or "0.25"), such as "/{number}" or
+// "/dist/pareto/{number}". Patterns are compiled once when added; matching
+// walks the target without allocating and converts parameters with
+// std::from_chars. The path of a target must match a route exactly; the
+// query string, if any, is handed over as is, see query_number().
+template <typename Id>
+class Router {
+public:
+    static constexpr size_t max_params = 4;
+
+    struct Match {
+        Id route;
+        std::array<double, max_params> params {};
+        size_t n_params = 0;
+        // Part of the target after '?', pointing into the target
+        std::string_view query;
+    };
+
+    // Add a route; throws std::invalid_argument on a malformed pattern
+    Router &add(std::string_view pattern, Id id) {
+        if(pattern.empty() || pattern.front() != '/') {
+            throw std::invalid_argument {"route must start with '/': " +
+                                         std::string {pattern}};
+        }
+
+        Route route {id, {}};
+        size_t n_params = 0;
+        for_each_segment(pattern, [&](std::string_view segment) {
+            if(segment == "{number}") {
+                if(++n_params > max_params) {
+                    throw std::invalid_argument {"too many parameters in route " +
+                                                 std::string {pattern}};
+                }
+                route.segments.push_back({Segment::Kind::number, {}});
+            } else if(segment.find_first_of("{}") != std::string_view::npos) {
+                throw std::invalid_argument {"unknown parameter in route " +
+                                             std::string {pattern}};
+            } else {
+                route.segments.push_back({Segment::Kind::literal, std::string {segment}});
+            }
+            return true;
+        });
+        m_routes.push_back(std::move(route));
+        return *this;
+    }
+
+    // First route matching `target`, in the order they were added
+    std::optional<Match> match(std::string_view target) const {
+        if(target.empty() || target.front() != '/') {
+            return std::nullopt;
+        }
+
+        std::string_view query;
+        if(const auto pos = target.find('?'); pos != std::string_view::npos) {
+            query = target.substr(pos + 1);
+            target = target.substr(0, pos);
+        }
+
+        for(const auto &route : m_routes) {
+            Match match {route.id, {}, 0, query};
+            size_t i = 0;
+            const auto matched = for_each_segment(target, [&](std::string_view segment) {
+                if(i == route.segments.size()) {
+                    return false;
+                }
+                const auto &expected = route.segments[i++];
+                if(expected.kind == Segment::Kind::literal) {
+                    return segment == expected.literal;
+                }
+                return parse_number(segment, match.params[match.n_params++]);
+            });
+            if(matched && i == route.segments.size()) {
+                return match;
+            }
+        }
+        return std::nullopt;
+    }
+
+private:
+    struct Segment {
+        enum class Kind { literal, number };
+
+        Kind kind;
+        std::string literal;
+    };
+
+    struct Route {
+        Id id;
+        std::vector<Segment> segments;
+    };
+
+    // Call `fn` on the segments of `path` (which starts with '/') until it
+    // returns false. Returns whether all segments were accepted.
+    template <typename Fn>
+    static bool for_each_segment(std::string_view path, Fn &&fn) {
+        size_t pos = 1;
+        for(;;) {
+            const auto end = path.find('/', pos);
+            if(!fn(path.substr(pos, end == std::string_view::npos ? end : end - pos))) {
+                return false;
+            }
+            if(end == std::string_view::npos) {
+                return true;
+            }
+            pos = end + 1;
+        }
+    }
+
+    // Digits, optionally followed by '.' and more digits
+    static bool parse_number(std::string_view s, double &value) {
+        const auto digits = [&](size_t pos) {
+            const auto start = pos;
+            while(pos < s.size() && s[pos] >= '0' && s[pos] <= '9') {
+                ++pos;
+            }
+            return pos > start ? pos : std::string_view::npos;
+        };
+
+        auto pos = digits(0);
+        if(pos != std::string_view::npos && pos < s.size() && s[pos] == '.') {
+            pos = digits(pos + 1);
+        }
+        if(pos != s.size()) {
+            return false;
+        }
+
+        const auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+        return ec == std::errc {} && ptr == s.data() + s.size();
+    }
+
+    std::vector<Route> m_routes;
+};
+
+// Value of the numeric parameter `name` of a query string like
+// "mu=0.5&sigma=1", or nothing if it is missing or not a finite number
+// (std::from_chars also accepts "nan" and "inf")
+inline std::optional<double>
+query_number(std::string_view query, std::string_view name) {
+    while(!query.empty()) {
+        const auto end = query.find('&');
+        const auto param = query.substr(0, end);
+        query = end == std::string_view::npos ? std::string_view {} : query.substr(end + 1);
+
+        const auto eq = param.find('=');
+        if(eq == std::string_view::npos || param.substr(0, eq) != name) {
+            continue;
+        }
+        const auto value = param.substr(eq + 1);
+        double result;
+        const auto *last = value.data() + value.size();
+        const auto [ptr, ec] = std::from_chars(value.data(), last, result);
+        if(ec != std::errc {} || ptr != last || !std::isfinite(result)) {
+            return std::nullopt;
+        }
+        return result;
+    }
+    return std::nullopt;
+}
+
+#endif
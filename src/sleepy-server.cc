@@ -6,10 +6,18 @@
 #include <coroutine>
 #endif
 
+#include <algorithm>
+#include <chrono>
 #include <concepts>
+#include <condition_variable>
 #include <cstdlib>
 #include <exception>
-#include <regex>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <optional>
+#include <stop_token>
 #include <string>
 
 #include <boost/algorithm/string.hpp>
@@ -18,8 +26,10 @@
 #include <boost/asio/co_spawn.hpp>
 #include <boost/asio/detached.hpp>
 #include <boost/asio/experimental/channel.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/this_coro.hpp>
-#include <boost/asio/thread_pool.hpp>
 #include <boost/asio/use_awaitable.hpp>
 
 #include <boost/beast/core.hpp>
@@ -30,7 +40,20 @@
 #include "spdlog/fmt/ostr.h"
 #include "spdlog/spdlog.h"
 
+#include "admission.hh"
+#include "clock_cache.hh"
+#include "fault_injection.hh"
+#include "io_backend.hh"
+#include "log_setup.hh"
+#include "metrics.hh"
+#include "metrics_http.hh"
 #include "my_result.hh"
+#include "options.hh"
+#include "response_template.hh"
+#include "router.hh"
+#include "socket_options.hh"
+#include "work_pool.hh"
+#include "workloads.hh"
 
 namespace beast = boost::beast;
 namespace http = beast::http;
@@ -40,110 +63,654 @@ namespace logging = spdlog;
 
 using net::ip::tcp;
 
+// Runtime settings
+struct SleepyConfig {
+    // Address to serve on; several instances may listen on different
+    // loopback addresses
+    std::string address = "127.0.0.1";
+    unsigned short port = 8081;
+
+    // Port of the Prometheus metrics endpoint, 0 disables it
+    unsigned short metrics_port = 9081;
+
+    // Time a kept-alive connection may stay idle between requests
+    std::chrono::steady_clock::duration keep_alive_timeout = std::chrono::seconds(30);
+    // Requests served on one connection before closing it, 0 means
+    // unlimited
+    size_t max_keep_alive_requests = 1000;
+
+    // Threads running background jobs
+    WorkPoolConfig work_pool;
+    // Load shedding in front of the work pool
+    AdmissionConfig admission;
+    // Run jobs on the IO thread instead of the work pool, to compare
+    bool inline_jobs = false;
+    // How /<delay> waits: "thread" blocks a work pool thread, "timer"
+    // waits on a timer of the IO context and uses no thread at all
+    std::string delay_mode = "thread";
+    // Random delays and injected faults
+    FaultConfig faults;
+
+    // Reactor to run on: auto, epoll or io_uring
+    std::string io_backend = "auto";
+
+    SocketOptions sockets;
+
+    LogConfig log;
+
+    static SleepyConfig from_options(const Options &options) {
+        SleepyConfig config;
+        config.address = options.get("address", config.address);
+        config.port = options.get("port", config.port);
+        config.metrics_port = options.get("metrics-port", config.metrics_port);
+        config.keep_alive_timeout =
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(options.get("keep-alive-timeout", 30.0)));
+        config.max_keep_alive_requests =
+            options.get("max-keep-alive-requests", config.max_keep_alive_requests);
+        config.work_pool = WorkPoolConfig::from_options(options);
+        config.admission = AdmissionConfig::from_options(options);
+        config.inline_jobs = options.get("inline-jobs", config.inline_jobs);
+        config.faults = FaultConfig::from_options(options);
+        config.delay_mode = options.get("delay-mode", config.delay_mode);
+        if(config.delay_mode != "thread" && config.delay_mode != "timer") {
+            throw std::invalid_argument {"--delay-mode must be thread or timer"};
+        }
+        config.io_backend = options.get("io-backend", config.io_backend);
+        config.sockets = SocketOptions::from_options(options);
+        config.log = LogConfig::from_options(options);
+        return config;
+    }
+};
+
+// Server metrics, registered on first use
+struct SleepyMetrics {
+    metrics::Histogram &request_duration {
+        metrics::registry().histogram("sleepy_request_duration_seconds",
+                                      "Time from reading a request to sending the response")};
+    metrics::Histogram &job_duration {metrics::registry().histogram(
+        "sleepy_job_duration_seconds", "Time spent running background jobs")};
+    metrics::Counter &requests {
+        metrics::registry().counter("sleepy_requests_total", "HTTP requests handled")};
+    metrics::Gauge &queue_depth {metrics::registry().gauge(
+        "sleepy_work_queue_depth", "Background jobs waiting for a work pool thread")};
+    metrics::Histogram &job_wait {metrics::registry().histogram(
+        "sleepy_job_wait_seconds", "Time background jobs waited for a work pool thread")};
+    metrics::Gauge &work_threads {metrics::registry().gauge(
+        "sleepy_work_pool_threads", "Threads running in the work pool")};
+    metrics::Counter &shed_queue_full {metrics::registry().counter(
+        "sleepy_shed_total", "Requests answered 503 because the server was overloaded",
+        {{"reason", "queue_full"}})};
+    metrics::Counter &shed_queue_wait {metrics::registry().counter(
+        "sleepy_shed_total", "Requests answered 503 because the server was overloaded",
+        {{"reason", "queue_wait"}})};
+    metrics::Counter &shed_codel {metrics::registry().counter(
+        "sleepy_shed_total", "Requests answered 503 because the server was overloaded",
+        {{"reason", "codel"}})};
+    metrics::Counter &cancelled_queued {metrics::registry().counter(
+        "sleepy_cancelled_jobs_total", "Background jobs cancelled because the client left",
+        {{"stage", "queued"}})};
+    metrics::Counter &cancelled_running {metrics::registry().counter(
+        "sleepy_cancelled_jobs_total", "Background jobs cancelled because the client left",
+        {{"stage", "running"}})};
+    metrics::Gauge &timer_delays {metrics::registry().gauge(
+        "sleepy_timer_delays", "Requests waiting on a timer (--delay-mode=timer)")};
+    metrics::Counter &injected_errors {metrics::registry().counter(
+        "sleepy_injected_faults_total", "Responses replaced with an injected fault",
+        {{"fault", "error"}})};
+    metrics::Counter &injected_resets {metrics::registry().counter(
+        "sleepy_injected_faults_total", "Responses replaced with an injected fault",
+        {{"fault", "reset"}})};
+    metrics::Counter &injected_truncations {metrics::registry().counter(
+        "sleepy_injected_faults_total", "Responses replaced with an injected fault",
+        {{"fault", "truncate"}})};
+    metrics::Gauge &active_connections {
+        metrics::registry().gauge("sleepy_active_connections", "Open HTTP connections")};
+    metrics::Counter &bytes_in {metrics::registry().counter("sleepy_received_bytes_total",
+                                                            "Bytes received from clients")};
+    metrics::Counter &bytes_out {
+        metrics::registry().counter("sleepy_sent_bytes_total", "Bytes sent to clients")};
+};
+
+SleepyMetrics &
+sleepy_metrics() {
+    static SleepyMetrics instance;
+    return instance;
+}
+
 // Get ISO 8601 - like string representation of current date and time
 // with millisecond precision
 std::string
 current_time_string() {
-    std::string result;
-    char buffer[26];
-    int millisec;
-    struct tm tm_info;
-    struct timeval tv;
+    return std::string {clock_cache().local_time()};
+}
+
+// State shared by all connections
+struct SleepyContext {
+    explicit SleepyContext(const SleepyConfig &config_):
+        config {config_},
+        work_pool {config.work_pool, sleepy_metrics().work_threads},
+        admission {config.admission},
+        faults {config.faults} {}
+
+    const SleepyConfig &config;
+    WorkPool work_pool;
+    AdmissionController admission;
+    FaultInjector faults;
+};
+
+// Requests a stop when the client closes its connection, for as long as
+// the watch lives. A request arriving first ends the watch, as a close
+// can't be seen behind it anymore. End of stream alone can't tell a client
+// that is gone from one that shut down its sending side and still reads
+// the responses, so it only counts for clients that are not pipelining:
+// once a request arrived while another was being served, the client is
+// taken to half-close on purpose and its EOF is ignored.
+class DisconnectWatch {
+public:
+    DisconnectWatch(tcp::socket &socket, bool pipelining):
+        m_socket {socket}, m_state {std::make_shared<State>()} {
+        m_state->pipelining = pipelining;
+        m_socket.async_wait(tcp::socket::wait_read,
+                            [state = m_state, &socket](beast::error_code ec) {
+                                if(ec || state->done) {
+                                    return;
+                                }
+                                if(socket.available(ec) > 0 && !ec) {
+                                    // The next request
+                                    state->pipelining = true;
+                                } else if(ec || !state->pipelining) {
+                                    // Readable but empty: end of stream
+                                    state->stop.request_stop();
+                                }
+                            });
+    }
+
+    DisconnectWatch(const DisconnectWatch &) = delete;
+    DisconnectWatch &operator=(const DisconnectWatch &) = delete;
 
-    gettimeofday(&tv, NULL);
+    ~DisconnectWatch() {
+        beast::error_code ec;
+        m_state->done = true;
+        m_socket.cancel(ec);
+    }
+
+    std::stop_token token() const {
+        return m_state->stop.get_token();
+    }
 
-    millisec = lrint(tv.tv_usec / 1000.0); // Round to nearest millisec
-    if(millisec >= 1000) {                 // Allow for rounding up to nearest second
-        millisec -= 1000;
-        tv.tv_sec++;
+    bool disconnected() const {
+        return m_state->stop.stop_requested();
     }
 
-    localtime_r(&tv.tv_sec, &tm_info);
+    // Whether the client sent a request while this one was being served,
+    // or was known to pipeline already
+    bool pipelining() const {
+        return m_state->pipelining;
+    }
 
-    strftime(buffer, 26, "%F %T", &tm_info);
-    return fmt::format("{}.{:03d}", buffer, millisec);
+private:
+    // Outlives the watch until the wait completes
+    struct State {
+        std::stop_source stop;
+        bool pipelining = false;
+        bool done = false;
+    };
+
+    tcp::socket &m_socket;
+    std::shared_ptr<State> m_state;
+};
+
+// A background job: produces the response body, or nothing if stopped
+// before the end
+using Job = std::function<std::optional<std::string>(std::stop_token)>;
+
+// Emulate a slow request handler without using CPU
+std::optional<std::string>
+sleep_job(float delay, std::stop_token stop) {
+    const auto t1 = current_time_string();
+    {
+        // Sleep, waking up early on a stop request
+        std::mutex mutex;
+        std::condition_variable_any wakeup;
+        std::unique_lock lock {mutex};
+        wakeup.wait_for(lock, stop, std::chrono::duration<float>(delay), [] { return false; });
+    }
+    if(stop.stop_requested()) {
+        return std::nullopt;
+    }
+    const auto t2 = current_time_string();
+    return fmt::format("Slept {:.3f} s from {} to {}", delay, t1, t2);
 }
 
-// Emulate CPU-intensive request handler
-net::awaitable<std::string>
-background_job(float delay) {
+// Same as sleep_job, on a timer of the IO context: any number of delays
+// may run at once without tying up threads
+net::awaitable<std::optional<std::string>>
+timer_sleep(float delay, std::stop_token stop) {
+    metrics::ScopedGauge waiting {sleepy_metrics().timer_delays};
+    net::steady_timer timer {co_await this_coro::executor,
+                             std::chrono::duration_cast<net::steady_timer::duration>(
+                                 std::chrono::duration<float>(delay))};
+    std::stop_callback on_stop {stop, [&timer] { timer.cancel(); }};
+
     const auto t1 = current_time_string();
-    logging::info("background job starts, delay={}", delay);
-    ::usleep(1e6 * delay);
+    beast::error_code ec;
+    if(!stop.stop_requested()) {
+        co_await timer.async_wait(net::redirect_error(net::use_awaitable, ec));
+    }
+    if(stop.stop_requested()) {
+        co_return std::nullopt;
+    }
     const auto t2 = current_time_string();
-    logging::info("background job ends, delay={}", delay);
     co_return fmt::format("Slept {:.3f} s from {} to {}", delay, t1, t2);
 }
 
-// This function produces an HTTP response for the given
-// request.
-template <class Body, class Allocator>
-net::awaitable<void>
-handle_request(net::thread_pool &work_pool, beast::tcp_stream &stream,
-               http::request<Body, http::basic_fields<Allocator>> &&req) {
-    const auto target = req.target().to_string();
-    std::smatch sm;
+// Hash `mib` MiB of data
+std::optional<std::string>
+hash_job(double mib, bool simd, std::stop_token stop) {
+    const auto start = std::chrono::steady_clock::now();
+    const auto size = static_cast<size_t>(mib * (1 << 20));
+    const auto hash =
+        simd ? workloads::hash_simd(size, stop) : workloads::hash_scalar(size, stop);
+    if(!hash) {
+        return std::nullopt;
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return fmt::format("Hashed {} MiB ({}) in {:.3f} s: {:08x}", mib,
+                       simd ? "simd" : "scalar", elapsed.count(), *hash);
+}
+
+// Multiply two `n` by `n` matrices
+std::optional<std::string>
+matmul_job(size_t n, bool simd, std::stop_token stop) {
+    const auto start = std::chrono::steady_clock::now();
+    const auto a = workloads::Matrix::sample(n, 1);
+    const auto b = workloads::Matrix::sample(n, 2);
+    const auto c =
+        simd ? workloads::matmul_simd(a, b, stop) : workloads::matmul_scalar(a, b, stop);
+    if(!c) {
+        return std::nullopt;
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return fmt::format("Multiplied {}x{} matrices ({}) in {:.3f} s: sum {:.6g}", n, n,
+                       simd ? "simd" : "scalar", elapsed.count(), c->sum());
+}
 
-    http::response<http::string_body> res;
+// Run a job on the calling thread and account for it
+std::optional<std::string>
+run_job(const Job &job, std::stop_token stop) {
+    auto &m = sleepy_metrics();
+    const auto start = std::chrono::steady_clock::now();
+
+    SPDLOG_INFO("background job starts");
+    auto result = job(stop);
+    if(!result) {
+        SPDLOG_INFO("background job cancelled");
+        m.cancelled_running.inc();
+        return std::nullopt;
+    }
+    SPDLOG_INFO("background job ends");
+    m.job_duration.observe(std::chrono::steady_clock::now() - start);
+    return result;
+}
 
-    res.version(req.version());
-    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-    res.set(http::field::content_type, "text/html");
+// Request handlers, by target
+enum class Route {
+    sleep,
+    lognormal,
+    pareto,
+    bimodal,
+    hash,
+    hash_simd,
+    matmul,
+    matmul_simd
+};
+
+// Run a background job on the work pool, unless the server is overloaded.
+// Returns nothing if the job was shed, either right away or once it got
+// a thread after waiting too long, or if it was stopped. With
+// --inline-jobs the job blocks the IO thread instead.
+net::awaitable<std::optional<std::string>>
+run_background_job(SleepyContext &ctx, Job job, std::stop_token stop) {
+    auto &m = sleepy_metrics();
+
+    if(ctx.config.inline_jobs) {
+        co_return run_job(job, stop);
+    }
+
+    const auto verdict = ctx.admission.admit(ctx.work_pool.queued(), ctx.work_pool.threads());
+    if(verdict != AdmissionController::Verdict::admit) {
+        auto &shed = verdict == AdmissionController::Verdict::queue_full ? m.shed_queue_full
+                                                                         : m.shed_queue_wait;
+        shed.inc();
+        co_return std::nullopt;
+    }
+
+    m.queue_depth.inc();
+    auto timed_job = [&ctx, &m, job = std::move(job), stop,
+                      queued_at = std::chrono::steady_clock::now()]()
+        -> std::optional<std::string> {
+        const auto start = std::chrono::steady_clock::now();
+        m.queue_depth.dec();
+        m.job_wait.observe(start - queued_at);
+
+        // Nobody is waiting for the result anymore
+        if(stop.stop_requested()) {
+            m.cancelled_queued.inc();
+            return std::nullopt;
+        }
+        if(ctx.admission.should_drop(start - queued_at)) {
+            m.shed_codel.inc();
+            return std::nullopt;
+        }
+
+        auto result = run_job(job, stop);
+        if(result) {
+            ctx.admission.finished(std::chrono::steady_clock::now() - start);
+        }
+        return result;
+    };
+    // Named: GCC 12 destroys lambda temporaries of a co_await expression twice
+    co_return co_await ctx.work_pool.run(std::move(timed_job));
+}
+
+// Routes are compiled once, on first use
+const Router<Route> &
+router() {
+    static const auto instance = Router<Route> {}
+                                     .add("/{number}", Route::sleep)
+                                     .add("/dist/lognormal", Route::lognormal)
+                                     .add("/dist/pareto", Route::pareto)
+                                     .add("/dist/bimodal", Route::bimodal)
+                                     .add("/cpu/hash/{number}", Route::hash)
+                                     .add("/cpu/hash/simd/{number}", Route::hash_simd)
+                                     .add("/cpu/matmul/{number}", Route::matmul)
+                                     .add("/cpu/matmul/simd/{number}", Route::matmul_simd);
+    return instance;
+}
+
+// Largest CPU jobs accepted. A matmul job holds three matrices, 12 MiB at
+// the largest size, and up to --work-threads-max of them run at once.
+constexpr double max_hash_mib = 4096;
+constexpr double max_matrix_size = 1024;
+// Largest delay accepted, fixed or as the `max` of sampled ones, in
+// seconds. Timers take nanoseconds in 64 bits, which overflow at about
+// 292 years.
+constexpr double max_delay = 24 * 3600;
+
+// Delay of a request to a delay route: fixed, or sampled from the
+// distribution given by the route and its query parameters. Returns
+// nothing for other routes and for parameters out of range.
+std::optional<float>
+request_delay(SleepyContext &ctx, const Router<Route>::Match &match) {
+    const auto query = [&](std::string_view name, double fallback) {
+        return query_number(match.query, name).value_or(fallback);
+    };
+
+    if(match.route == Route::sleep) {
+        const auto delay = match.params[0];
+        if(!(delay <= max_delay)) {
+            return std::nullopt;
+        }
+        return static_cast<float>(delay);
+    }
+
+    // Tails are cut at `max` seconds
+    const auto max = query("max", 60);
+    if(max < 0 || max > max_delay) {
+        return std::nullopt;
+    }
+
+    double delay;
+    switch(match.route) {
+    case Route::lognormal: {
+        const auto sigma = query("sigma", 1);
+        if(sigma < 0) {
+            return std::nullopt;
+        }
+        delay = ctx.faults.lognormal(query("mu", -2), sigma);
+        break;
+    }
+    case Route::pareto: {
+        const auto scale = query("scale", 0.05);
+        const auto alpha = query("alpha", 1.5);
+        if(scale <= 0 || alpha <= 0) {
+            return std::nullopt;
+        }
+        delay = ctx.faults.pareto(scale, alpha);
+        break;
+    }
+    case Route::bimodal: {
+        const auto fast = query("fast", 0.01);
+        const auto slow = query("slow", 1);
+        const auto p = query("p", 0.05);
+        if(fast < 0 || slow < 0 || p < 0 || p > 1) {
+            return std::nullopt;
+        }
+        delay = ctx.faults.bimodal(fast, slow, p);
+        break;
+    }
+    default:
+        return std::nullopt;
+    }
+
+    return static_cast<float>(std::clamp(delay, 0.0, max));
+}
+
+// Work to do for a request
+struct RequestPlan {
+    // Produces the response body; empty if parameters are out of range
+    Job job;
+    // Set for delay routes, which may wait on a timer instead
+    std::optional<float> delay;
+    Fault fault = Fault::none;
+};
+
+RequestPlan
+plan_request(SleepyContext &ctx, const Router<Route>::Match &match) {
+    const auto param = match.params[0];
+    RequestPlan plan;
+
+    switch(match.route) {
+    case Route::sleep:
+    case Route::lognormal:
+    case Route::pareto:
+    case Route::bimodal:
+        plan.delay = request_delay(ctx, match);
+        if(plan.delay) {
+            plan.job = [delay = *plan.delay](std::stop_token stop) {
+                return sleep_job(delay, stop);
+            };
+        }
+        break;
+    case Route::hash:
+    case Route::hash_simd:
+        if(param <= max_hash_mib) {
+            plan.job = [param, simd = match.route == Route::hash_simd](std::stop_token stop) {
+                return hash_job(param, simd, stop);
+            };
+        }
+        break;
+    case Route::matmul:
+    case Route::matmul_simd:
+        if(param >= 1 && param <= max_matrix_size && param == static_cast<size_t>(param)) {
+            plan.job = [n = static_cast<size_t>(param),
+                        simd = match.route == Route::matmul_simd](std::stop_token stop) {
+                return matmul_job(n, simd, stop);
+            };
+        }
+        break;
+    }
+
+    // Fault rates may be overridden per request
+    const auto &defaults = ctx.faults.config();
+    const auto error = query_number(match.query, "error").value_or(defaults.error_rate);
+    const auto reset = query_number(match.query, "reset").value_or(defaults.reset_rate);
+    const auto truncate =
+        query_number(match.query, "truncate").value_or(defaults.truncate_rate);
+    if(!FaultConfig::valid_rates(error, reset, truncate)) {
+        plan.job = {};
+    } else if(plan.job) {
+        plan.fault = ctx.faults.fault(error, reset, truncate);
+    }
+    return plan;
+}
+
+// Responses, serialized once on first use
+struct Responses {
+    ResponseTemplate ok {http::status::ok, BOOST_BEAST_VERSION_STRING, "text/html"};
+    ResponseTemplate bad_method {http::status::bad_request, BOOST_BEAST_VERSION_STRING,
+                                 "text/html", "Unknown HTTP-method"};
+    ResponseTemplate bad_parameter {http::status::bad_request, BOOST_BEAST_VERSION_STRING,
+                                    "text/html", "Parameter out of range\n"};
+    ResponseTemplate not_found {http::status::not_found, BOOST_BEAST_VERSION_STRING,
+                                "text/html", "Not found\n"};
+    ResponseTemplate overloaded {http::status::service_unavailable,
+                                 BOOST_BEAST_VERSION_STRING, "text/html", "Overloaded\n"};
+    ResponseTemplate injected_error {http::status::internal_server_error,
+                                     BOOST_BEAST_VERSION_STRING, "text/html",
+                                     "Injected error\n"};
+};
+
+const Responses &
+responses() {
+    static const Responses instance;
+    return instance;
+}
+
+// This function produces an HTTP response for the given
+// request. The response tells the client whether the connection is kept
+// open afterwards. `pipelining` tells whether the client sends requests
+// without waiting for responses, and is updated. Returns false if the
+// connection can't be used anymore.
+template <class Body, class Allocator>
+net::awaitable<bool>
+handle_request(SleepyContext &ctx, beast::tcp_stream &stream,
+               http::request<Body, http::basic_fields<Allocator>> &&req, bool keep_alive,
+               bool &pipelining) {
+    const auto start = std::chrono::steady_clock::now();
+    auto &m = sleepy_metrics();
+    const auto &templates = responses();
+    const ResponseTemplate *response = &templates.not_found;
+    std::optional<std::string> body;
+    std::string extra_headers;
+
+    m.requests.inc();
+
+    const auto route = router().match({req.target().data(), req.target().size()});
+    auto plan = route ? plan_request(ctx, *route) : RequestPlan {};
 
     // Make sure we can handle the method
     if(req.method() != http::verb::get) {
-        res.result(http::status::bad_request);
-        res.body() = "Unknown HTTP-method";
-        res.prepare_payload();
+        response = &templates.bad_method;
         logging::error("bad http method: {}", req.method());
-        goto send;
-    }
-
-    if(std::regex_match(target, sm, std::regex {"/((\\d+\\.)?\\d+)"})) {
-        const auto delay = std::stof(sm[1]);
-        logging::info("scheduling background job, delay={}", delay);
-        res.result(http::status::ok);
+    } else if(plan.job) {
+        SPDLOG_INFO("scheduling background job for {}", req.target());
 
         // Offload CPU-intensive processing to a separate thread pool.
-        res.body() =
-            co_await net::co_spawn(work_pool, background_job(delay), net::use_awaitable);
-        res.prepare_payload();
-    } else {
-        res.result(http::status::not_found);
-        res.body() = "Not found\n";
-        res.prepare_payload();
+        // The job is cancelled if the client leaves in the meantime.
+        DisconnectWatch watch {stream.socket(), pipelining};
+        if(plan.delay && ctx.config.delay_mode == "timer") {
+            body = co_await timer_sleep(*plan.delay, watch.token());
+        } else {
+            body = co_await run_background_job(ctx, std::move(plan.job), watch.token());
+        }
+        pipelining = watch.pipelining();
+        if(watch.disconnected()) {
+            SPDLOG_INFO("client went away, dropping response");
+            co_return false;
+        }
+        if(body && plan.fault == Fault::error) {
+            m.injected_errors.inc();
+            body.reset();
+            response = &templates.injected_error;
+        } else if(body && plan.fault == Fault::reset) {
+            // Abort the connection: closing with a zero linger time sends RST
+            m.injected_resets.inc();
+            beast::error_code ec;
+            stream.socket().set_option(net::socket_base::linger(true, 0), ec);
+            stream.socket().close(ec);
+            co_return false;
+        } else if(body) {
+            response = &templates.ok;
+        } else {
+            // Overloaded: tell the client when the queue should have
+            // drained
+            const auto wait = ctx.admission.estimated_wait(ctx.work_pool.queued(),
+                                                           ctx.work_pool.threads());
+            response = &templates.overloaded;
+            extra_headers = fmt::format(
+                "Retry-After: {}\r\n",
+                std::max<int64_t>(1, std::chrono::ceil<std::chrono::seconds>(wait).count()));
+        }
+    } else if(route) {
+        response = &templates.bad_parameter;
     }
 
-send:
-    logging::info("sending http response, status={}", res.result());
-    co_await http::async_write(stream, res, net::use_awaitable);
-    co_return;
+    // Write the prepared head, the varying headers and the body at once
+    const auto date = clock_cache().http_date();
+    auto wire =
+        body ? response->with_body(req.version(), keep_alive, date, *body, extra_headers)
+             : response->wire(req.version(), keep_alive, date, extra_headers);
+    const auto truncate = body && plan.fault == Fault::truncate;
+    if(truncate) {
+        // Announce the whole body, send half of it and close
+        m.injected_truncations.inc();
+        wire.truncate_body(body->size() / 2);
+    }
+    SPDLOG_INFO("sending http response, status={}", response->status());
+    stream.expires_after(std::chrono::seconds(30));
+    m.bytes_out.inc(co_await net::async_write(stream, wire.buffers(), net::use_awaitable));
+    m.request_duration.observe(std::chrono::steady_clock::now() - start);
+    co_return !truncate;
 }
 
 //------------------------------------------------------------------------------
 
-// Handles an HTTP server connection
+// Handles an HTTP server connection. Requests are served one after the
+// other for as long as the client keeps the connection alive; pipelined
+// requests wait in the read buffer and are answered in order.
 net::awaitable<void>
-http_client(net::thread_pool &work_pool, beast::tcp_stream stream) {
-    bool close = false;
+http_client(SleepyContext &ctx, beast::tcp_stream stream) {
+    const auto &config = ctx.config;
     beast::error_code ec;
+    metrics::ScopedGauge connection {sleepy_metrics().active_connections};
 
     // This buffer is required to persist across reads
     beast::flat_buffer buffer;
-
-    // This lambda is used to send messages
-    // send_lambda lambda {stream, close, ec, yield};
-
-    // Set the timeout.
-    stream.expires_after(std::chrono::seconds(30));
+    // Whether the client sent a request before the previous response
+    bool pipelining = false;
 
     try {
-        // Read a request
-        http::request<http::string_body> req;
-        co_await http::async_read(stream, buffer, req, net::use_awaitable);
-        logging::info("request location '{}'", req.target());
-        // Send the response
-        co_await handle_request(work_pool, stream, std::move(req));
+        for(size_t served = 1;; ++served) {
+            // Read a request, waiting at most the idle timeout for it
+            stream.expires_after(config.keep_alive_timeout);
+            http::request<http::string_body> req;
+            sleepy_metrics().bytes_in.inc(
+                co_await http::async_read(stream, buffer, req, net::use_awaitable));
+            SPDLOG_INFO("request location '{}'", req.target());
+            // Further requests read along with this one
+            pipelining = pipelining || buffer.size() > 0;
+
+            const auto keep_alive =
+                req.keep_alive() && (config.max_keep_alive_requests == 0 ||
+                                     served < config.max_keep_alive_requests);
+
+            // Send the response
+            if(!co_await handle_request(ctx, stream, std::move(req), keep_alive,
+                                        pipelining) ||
+               !keep_alive) {
+                break;
+            }
+        }
+    } catch(const boost::system::system_error &e) {
+        // The client closed or abandoned an idle connection
+        if(const auto code = e.code();
+           code == http::error::end_of_stream || code == beast::error::timeout) {
+            SPDLOG_DEBUG("http client went away: {}", code.message());
+        } else {
+            logging::error("http_client got exception {}", e.what());
+        }
     } catch(const std::exception &e) {
         logging::error("http_client got exception {}", e.what());
     }
@@ -158,7 +725,8 @@ http_client(net::thread_pool &work_pool, beast::tcp_stream stream) {
 
 // Accepts incoming connections and launches the sessions
 net::awaitable<void>
-http_listen(net::thread_pool &work_pool, tcp::endpoint endpoint) {
+http_listen(SleepyContext &ctx, tcp::endpoint endpoint) {
+    const auto &config = ctx.config;
     auto ioc = co_await this_coro::executor;
     beast::error_code ec;
 
@@ -177,6 +745,8 @@ http_listen(net::thread_pool &work_pool, tcp::endpoint endpoint) {
         co_return;
     }
 
+    socket_options::apply_listener(acceptor, config.sockets);
+
     // Bind to the server address
     acceptor.bind(endpoint, ec);
     if(ec) {
@@ -195,24 +765,49 @@ http_listen(net::thread_pool &work_pool, tcp::endpoint endpoint) {
     for(;;) {
         tcp::socket socket {ioc};
         co_await acceptor.async_accept(socket, net::use_awaitable);
-        logging::info("http request from {}", socket.remote_endpoint());
-        net::co_spawn(ioc, http_client(work_pool, beast::tcp_stream {std::move(socket)}),
+        SPDLOG_INFO("http request from {}", socket.remote_endpoint());
+        socket_options::apply_accepted(socket, config.sockets);
+        net::co_spawn(ioc, http_client(ctx, beast::tcp_stream {std::move(socket)}),
                       net::detached);
     }
 }
 
 int
-main(int, char **) {
-    const size_t n_threads = 2;
+main(int argc, char **argv) {
+    SleepyConfig config;
+
+    try {
+        const Options options {argc, argv};
+        config = SleepyConfig::from_options(options);
+        options.reject_unknown();
+        io_backend::select(config.io_backend, argv);
+    } catch(const std::exception &e) {
+        logging::error("{}", e.what());
+        return EXIT_FAILURE;
+    }
+
+    setup_logging(config.log);
+
     net::io_context ioc;
-    net::thread_pool work_pool {n_threads};
+    SleepyContext ctx {config};
 
-    auto const address = net::ip::make_address("127.0.0.1");
-    auto const port = static_cast<unsigned short>(8081);
+    beast::error_code ec;
+    auto const address = net::ip::make_address(config.address, ec);
+    if(ec) {
+        logging::error("--address: invalid address '{}'", config.address);
+        return EXIT_FAILURE;
+    }
+    auto const port = config.port;
 
     logging::set_pattern("[%Y-%m-%d %H:%M:%S.%e] [%t] [%^%l%$] %v");
 
-    net::co_spawn(ioc, http_listen(work_pool, tcp::endpoint {address, port}), net::detached);
+    net::co_spawn(ioc, http_listen(ctx, tcp::endpoint {address, port}),
+                  net::detached);
+
+    if(config.metrics_port != 0) {
+        net::co_spawn(ioc, metrics::serve(tcp::endpoint {address, config.metrics_port}),
+                      net::detached);
+    }
 
     ioc.run();
     return EXIT_SUCCESS;
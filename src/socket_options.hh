@@ -0,0 +1,181 @@
+#ifndef SOCKET_OPTIONS_HH_
+#define SOCKET_OPTIONS_HH_
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <boost/asio/ip/tcp.hpp>
+
+#include "spdlog/spdlog.h"
+
+#include "options.hh"
+
+// Socket tuning applied to listeners, accepted sockets and upstream
+// connections. Options the kernel refuses (e.g. SO_BUSY_POLL without
+// CAP_NET_ADMIN) are logged once and not tried again.
+struct SocketOptions {
+    // Disable Nagle's algorithm (TCP_NODELAY)
+    bool nodelay = true;
+    // SO_SNDBUF / SO_RCVBUF in bytes, 0 keeps the kernel default
+    int send_buffer = 0;
+    int receive_buffer = 0;
+    // TCP_FASTOPEN queue length on listening sockets, 0 disables
+    int fastopen_queue = 0;
+    // TCP_FASTOPEN_CONNECT on outgoing connections. Opt-in only: with a
+    // cached cookie connect() succeeds at once, without the peer being
+    // known to be reachable, which defeats the Happy Eyeballs race, the
+    // balancer's connect outcome reports and the connect stage timing.
+    bool fastopen_connect = false;
+    // TCP_QUICKACK. Linux clears it again on its own, so this only affects
+    // the start of a connection.
+    bool quickack = false;
+    // SO_BUSY_POLL in microseconds, 0 disables
+    int busy_poll = 0;
+
+    // Predefined profiles: "kernel" (no tuning at all), "default" (only
+    // TCP_NODELAY), "latency" and "throughput"
+    static SocketOptions profile(const std::string &name) {
+        SocketOptions o;
+
+        if(name == "kernel") {
+            o.nodelay = false;
+        } else if(name == "default") {
+        } else if(name == "latency") {
+            o.fastopen_queue = 256;
+            o.quickack = true;
+            o.busy_poll = 50;
+        } else if(name == "throughput") {
+            o.send_buffer = 4 << 20;
+            o.receive_buffer = 4 << 20;
+            o.fastopen_queue = 256;
+        } else {
+            throw std::invalid_argument {"--socket-profile: unknown profile '" + name + "'"};
+        }
+
+        return o;
+    }
+
+    // Start from --socket-profile and apply individual overrides
+    static SocketOptions from_options(const Options &options) {
+        auto o = profile(options.get("socket-profile", "default"));
+        o.nodelay = options.get("tcp-nodelay", o.nodelay);
+        o.send_buffer = options.get("so-sndbuf", o.send_buffer);
+        o.receive_buffer = options.get("so-rcvbuf", o.receive_buffer);
+        o.fastopen_queue = options.get("tcp-fastopen", o.fastopen_queue);
+        o.fastopen_connect = options.get("tcp-fastopen-connect", o.fastopen_connect);
+        o.quickack = options.get("tcp-quickack", o.quickack);
+        o.busy_poll = options.get("so-busy-poll", o.busy_poll);
+        return o;
+    }
+};
+
+namespace socket_options {
+
+namespace detail {
+
+// A socket option, skipped once the kernel refused it: a refusal such as
+// EPERM for SO_BUSY_POLL applies to every socket, so it is logged once
+struct Option {
+    int level;
+    int name;
+    const char *what;
+    std::atomic<bool> refused {false};
+};
+
+inline Option so_sndbuf {SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF"};
+inline Option so_rcvbuf {SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF"};
+#if defined(SO_BUSY_POLL)
+inline Option so_busy_poll {SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL"};
+#endif
+#if defined(TCP_FASTOPEN)
+inline Option tcp_fastopen {IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN"};
+#endif
+inline Option tcp_nodelay {IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY"};
+#if defined(TCP_QUICKACK)
+inline Option tcp_quickack {IPPROTO_TCP, TCP_QUICKACK, "TCP_QUICKACK"};
+#endif
+#if defined(TCP_FASTOPEN_CONNECT)
+inline Option tcp_fastopen_connect {IPPROTO_TCP, TCP_FASTOPEN_CONNECT, "TCP_FASTOPEN_CONNECT"};
+#endif
+
+template <typename Socket>
+void
+set(Socket &socket, Option &option, int value) {
+    if(option.refused.load(std::memory_order_relaxed)) {
+        return;
+    }
+    const auto fd = socket.native_handle();
+    if(::setsockopt(fd, option.level, option.name, &value, sizeof(value)) != 0) {
+        const auto error = errno;
+        if(!option.refused.exchange(true)) {
+            spdlog::warn("cannot set {}={}: {}, not trying again", option.what, value,
+                         std::strerror(error));
+        }
+    }
+}
+
+// Options shared by listening and connected sockets. Buffer sizes set on
+// a listener are inherited by the sockets it accepts, and must be set
+// before connecting to affect the TCP window scale.
+template <typename Socket>
+void
+apply_common(Socket &socket, const SocketOptions &o) {
+    if(o.send_buffer > 0) {
+        set(socket, so_sndbuf, o.send_buffer);
+    }
+    if(o.receive_buffer > 0) {
+        set(socket, so_rcvbuf, o.receive_buffer);
+    }
+#if defined(SO_BUSY_POLL)
+    if(o.busy_poll > 0) {
+        set(socket, so_busy_poll, o.busy_poll);
+    }
+#endif
+}
+
+} // namespace detail
+
+// Apply to an open, not yet listening acceptor
+inline void
+apply_listener(boost::asio::ip::tcp::acceptor &acceptor, const SocketOptions &o) {
+    detail::apply_common(acceptor, o);
+#if defined(TCP_FASTOPEN)
+    if(o.fastopen_queue > 0) {
+        detail::set(acceptor, detail::tcp_fastopen, o.fastopen_queue);
+    }
+#endif
+}
+
+// Apply to an accepted socket
+inline void
+apply_accepted(boost::asio::ip::tcp::socket &socket, const SocketOptions &o) {
+    detail::set(socket, detail::tcp_nodelay, o.nodelay);
+#if defined(TCP_QUICKACK)
+    if(o.quickack) {
+        detail::set(socket, detail::tcp_quickack, 1);
+    }
+#endif
+}
+
+// Apply to an open socket before connecting it
+inline void
+apply_upstream(boost::asio::ip::tcp::socket &socket, const SocketOptions &o) {
+    detail::apply_common(socket, o);
+    apply_accepted(socket, o);
+#if defined(TCP_FASTOPEN_CONNECT)
+    if(o.fastopen_connect) {
+        detail::set(socket, detail::tcp_fastopen_connect, 1);
+    }
+#endif
+}
+
+} // namespace socket_options
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef TOKEN_BUCKET_HH_
+#define TOKEN_BUCKET_HH_
+
+#include <algorithm>
+#include <chrono>
+
+// Token bucket: refills at `rate` tokens per second up to `capacity`.
+// A rate of 0 means unlimited. Not thread safe.
+class TokenBucket {
+public:
+    using clock = std::chrono::steady_clock;
+
+    TokenBucket(double rate, double capacity):
+        m_rate {rate}, m_capacity {capacity}, m_tokens {capacity}, m_last {clock::now()} {}
+
+    // Whether `n` tokens can be taken now. A request larger than the
+    // capacity can never find enough tokens; it is allowed once the bucket
+    // is full, and leaves it in debt until the excess has refilled, so the
+    // long-term rate still holds.
+    bool can_consume(double n) {
+        if(m_rate <= 0) {
+            return true;
+        }
+
+        const auto now = clock::now();
+        const auto elapsed = std::chrono::duration<double>(now - m_last).count();
+        m_tokens = std::min(m_capacity, m_tokens + m_rate * elapsed);
+        m_last = now;
+        return m_tokens >= std::min(n, m_capacity);
+    }
+
+    // Take `n` tokens, after can_consume() allowed it
+    void consume(double n) {
+        if(m_rate > 0) {
+            m_tokens -= n;
+        }
+    }
+
+private:
+    const double m_rate;
+    const double m_capacity;
+    double m_tokens;
+    clock::time_point m_last;
+};
+
+#endif
@@ -0,0 +1,402 @@
+#ifndef UPSTREAM_HH_
+#define UPSTREAM_HH_
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include "adaptive_limit.hh"
+#include "balancer.hh"
+#include "metrics.hh"
+#include "options.hh"
+
+// Per upstream (host, port) state shared by all fetches to it
+
+struct BreakerConfig {
+    bool enabled = true;
+    // Consecutive failures that open the circuit, 0 disables the rule
+    unsigned failures = 5;
+    // Failure ratio over the last `window` fetches that opens the circuit,
+    // 0 disables the rule
+    double error_rate = 0.5;
+    size_t window = 20;
+    // Time the circuit stays open before probing the upstream again
+    std::chrono::steady_clock::duration open_time = std::chrono::seconds(5);
+    // Successful probes needed to close the circuit, also the number of
+    // probes allowed at the same time
+    unsigned probes = 1;
+
+    static BreakerConfig from_options(const Options &options) {
+        BreakerConfig config;
+        config.enabled = options.get("circuit-breaker", config.enabled);
+        config.failures = options.get("breaker-failures", config.failures);
+        config.error_rate = options.get("breaker-error-rate", config.error_rate);
+        config.window = options.get("breaker-window", config.window);
+        config.open_time = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(options.get("breaker-open-time", 5.0)));
+        config.probes = options.get("breaker-probes", config.probes);
+
+        if(config.error_rate < 0 || config.error_rate > 1) {
+            throw std::invalid_argument {"--breaker-error-rate must be between 0 and 1"};
+        }
+        if(config.window == 0 || config.probes == 0) {
+            throw std::invalid_argument {
+                "--breaker-window and --breaker-probes must be positive"};
+        }
+        return config;
+    }
+};
+
+// Circuit breaker: closed (fetches pass), open (fetches fail fast) and
+// half-open (a few probe fetches decide whether to close or open again).
+// Not thread safe: use from a single executor.
+class CircuitBreaker {
+public:
+    using clock = std::chrono::steady_clock;
+
+    enum class State { closed = 0, open = 1, half_open = 2 };
+
+    // A fetch let through by the breaker. Report its outcome with
+    // success() or failure(); a fetch dropped without either (e.g.
+    // cancelled) does not count.
+    class Admission {
+    public:
+        explicit Admission(CircuitBreaker *breaker, bool probe):
+            m_breaker {breaker}, m_probe {probe} {}
+        Admission(Admission &&other) noexcept:
+            m_breaker {std::exchange(other.m_breaker, nullptr)}, m_probe {other.m_probe} {}
+        Admission &operator=(Admission &&other) noexcept {
+            std::swap(m_breaker, other.m_breaker);
+            std::swap(m_probe, other.m_probe);
+            return *this;
+        }
+        ~Admission() {
+            if(m_breaker && m_probe) {
+                --m_breaker->m_probes_inflight;
+            }
+        }
+
+        void success() {
+            if(auto *breaker = std::exchange(m_breaker, nullptr)) {
+                breaker->on_success(m_probe);
+            }
+        }
+
+        void failure() {
+            if(auto *breaker = std::exchange(m_breaker, nullptr)) {
+                breaker->on_failure(m_probe);
+            }
+        }
+
+    private:
+        CircuitBreaker *m_breaker;
+        bool m_probe;
+    };
+
+    CircuitBreaker(std::string name, const BreakerConfig &config, metrics::Gauge &state_gauge):
+        m_name {std::move(name)},
+        m_config {config},
+        m_state_gauge {state_gauge},
+        m_window(config.window, false) {}
+
+    // Let a fetch through, or return nothing if it must fail fast
+    std::optional<Admission> admit() {
+        if(!m_config.enabled) {
+            return Admission {nullptr, false};
+        }
+
+        if(m_state == State::open) {
+            if(clock::now() - m_opened_at < m_config.open_time) {
+                return std::nullopt;
+            }
+            set_state(State::half_open);
+        }
+
+        if(m_state == State::half_open) {
+            if(m_probes_inflight >= m_config.probes) {
+                return std::nullopt;
+            }
+            ++m_probes_inflight;
+            return Admission {this, true};
+        }
+
+        return Admission {this, false};
+    }
+
+    State state() const {
+        return m_state;
+    }
+
+private:
+    void on_success(bool probe) {
+        if(probe) {
+            --m_probes_inflight;
+            if(m_state == State::half_open && ++m_probe_successes >= m_config.probes) {
+                set_state(State::closed);
+            }
+            return;
+        }
+
+        m_consecutive_failures = 0;
+        record(false);
+    }
+
+    void on_failure(bool probe) {
+        if(probe) {
+            --m_probes_inflight;
+            if(m_state == State::half_open) {
+                set_state(State::open);
+            }
+            return;
+        }
+
+        ++m_consecutive_failures;
+        record(true);
+
+        if(m_state != State::closed) {
+            return;
+        }
+        const auto too_many_failures =
+            m_config.failures > 0 && m_consecutive_failures >= m_config.failures;
+        const auto error_rate_exceeded =
+            m_config.error_rate > 0 && m_recorded == m_window.size() &&
+            m_window_failures >= m_config.error_rate * m_window.size();
+        if(too_many_failures || error_rate_exceeded) {
+            set_state(State::open);
+        }
+    }
+
+    // Add an outcome to the sliding window of the last fetches
+    void record(bool failed) {
+        if(m_recorded == m_window.size()) {
+            m_window_failures -= m_window[m_next];
+        } else {
+            ++m_recorded;
+        }
+        m_window[m_next] = failed;
+        m_window_failures += failed;
+        m_next = (m_next + 1) % m_window.size();
+    }
+
+    void set_state(State state) {
+        if(state == m_state) {
+            return;
+        }
+
+        static constexpr const char *names[] = {"closed", "open", "half-open"};
+        const auto level = state == State::open ? spdlog::level::warn : spdlog::level::info;
+        spdlog::log(level, "circuit breaker for {} is {}", m_name,
+                    names[static_cast<int>(state)]);
+
+        m_state = state;
+        m_state_gauge.set(static_cast<int64_t>(state));
+        m_probe_successes = 0;
+
+        if(state == State::open) {
+            m_opened_at = clock::now();
+        } else if(state == State::closed) {
+            // Start over, so the failures that opened the circuit don't
+            // open it again right away
+            m_consecutive_failures = 0;
+            m_window_failures = 0;
+            m_recorded = 0;
+            m_next = 0;
+        }
+    }
+
+    const std::string m_name;
+    const BreakerConfig m_config;
+    metrics::Gauge &m_state_gauge;
+
+    State m_state = State::closed;
+    clock::time_point m_opened_at;
+    unsigned m_consecutive_failures = 0;
+    unsigned m_probes_inflight = 0;
+    unsigned m_probe_successes = 0;
+
+    std::vector<bool> m_window;
+    size_t m_next = 0;
+    size_t m_recorded = 0;
+    size_t m_window_failures = 0;
+};
+
+// Settings shared by all upstreams
+struct UpstreamConfig {
+    // Fail fast on upstreams that keep failing
+    BreakerConfig breaker;
+    // Concurrency limit, adjusted to latency and errors
+    AdaptiveLimitConfig limit;
+    // Choice between the addresses of an upstream
+    BalancerConfig balancer;
+    // Upstreams with state kept at most, and the time an upstream no fetch
+    // uses keeps it
+    size_t max_upstreams = 1024;
+    std::chrono::steady_clock::duration idle_timeout = std::chrono::minutes(5);
+
+    static UpstreamConfig from_options(const Options &options) {
+        UpstreamConfig config;
+        config.breaker = BreakerConfig::from_options(options);
+        config.limit = AdaptiveLimitConfig::from_options(options);
+        config.balancer = BalancerConfig::from_options(options);
+        config.max_upstreams = options.get("max-upstreams", config.max_upstreams);
+        config.idle_timeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(options.get("upstream-idle-timeout", 300.0)));
+
+        if(config.max_upstreams == 0) {
+            throw std::invalid_argument {"--max-upstreams must be positive"};
+        }
+        return config;
+    }
+};
+
+// An upstream server, identified by "host:port". Its metric series are
+// unregistered with it.
+struct Upstream {
+    Upstream(const std::string &name_, const UpstreamConfig &config):
+        name {name_},
+        breaker {name, config.breaker,
+                 metrics::registry().gauge(circuit_state_metric,
+                                           "Circuit breaker state of an upstream: 0 closed, "
+                                           "1 open, 2 half-open",
+                                           labels())},
+        rejected {metrics::registry().counter(
+            rejected_metric, "Fetches failed fast because the circuit breaker was open",
+            labels())},
+        limiter {config.limit},
+        concurrency_limit {metrics::registry().gauge(
+            concurrency_limit_metric,
+            "Fetches allowed in flight to an upstream at the same time", labels())},
+        balancer {config.balancer,
+                  metrics::registry().counter(ejections_metric,
+                                              "Addresses of an upstream ejected after "
+                                              "repeated failures",
+                                              labels())},
+        last_used {std::chrono::steady_clock::now()} {
+        concurrency_limit.set(static_cast<int64_t>(limiter.limit()));
+    }
+
+    Upstream(const Upstream &) = delete;
+    Upstream &operator=(const Upstream &) = delete;
+
+    ~Upstream() {
+        for(const auto *metric : {circuit_state_metric, rejected_metric,
+                                  concurrency_limit_metric, ejections_metric}) {
+            metrics::registry().remove(metric, labels());
+        }
+    }
+
+    const std::string name;
+    CircuitBreaker breaker;
+    metrics::Counter &rejected;
+    AdaptiveLimiter limiter;
+    metrics::Gauge &concurrency_limit;
+    EndpointBalancer balancer;
+    // Start of the last fetch
+    std::chrono::steady_clock::time_point last_used;
+
+private:
+    static constexpr const char *circuit_state_metric = "proxy_upstream_circuit_state";
+    static constexpr const char *rejected_metric = "proxy_upstream_circuit_rejected_total";
+    static constexpr const char *concurrency_limit_metric = "proxy_upstream_concurrency_limit";
+    static constexpr const char *ejections_metric = "proxy_upstream_endpoint_ejections_total";
+
+    metrics::Labels labels() const {
+        return {{"upstream", name}};
+    }
+};
+
+// Upstreams by "host:port". Fetches hold on to the upstream they use.
+//
+// Entries are only created for upstreams whose name resolved, so made-up
+// host names leave nothing behind. Entries no fetch holds are dropped once
+// idle for `idle_timeout`, and when the registry is full, the least
+// recently used of them makes room. Not thread safe: use from a single
+// executor.
+class UpstreamRegistry {
+public:
+    using clock = std::chrono::steady_clock;
+
+    explicit UpstreamRegistry(const UpstreamConfig &config):
+        m_config {config},
+        m_size {metrics::registry().gauge("proxy_upstreams",
+                                          "Upstreams with state kept by the proxy")} {}
+
+    // The upstream if it has an entry, or nothing
+    std::shared_ptr<Upstream> find(const std::string &host, const std::string &port) {
+        const auto it = m_upstreams.find(host + ":" + port);
+        if(it == m_upstreams.end()) {
+            return nullptr;
+        }
+        it->second->last_used = clock::now();
+        return it->second;
+    }
+
+    // The upstream, with an entry created if needed. Returns nothing if
+    // the registry is full of upstreams in use.
+    std::shared_ptr<Upstream> get(const std::string &host, const std::string &port) {
+        if(auto upstream = find(host, port)) {
+            return upstream;
+        }
+
+        evict_idle();
+        if(m_upstreams.size() >= m_config.max_upstreams && !evict_least_recent()) {
+            return nullptr;
+        }
+
+        auto name = host + ":" + port;
+        auto upstream = std::make_shared<Upstream>(name, m_config);
+        m_upstreams.emplace(std::move(name), upstream);
+        m_size.set(static_cast<int64_t>(m_upstreams.size()));
+        return upstream;
+    }
+
+private:
+    // Held by a fetch, or by a connection attempt still reporting to it
+    static bool in_use(const std::shared_ptr<Upstream> &upstream) {
+        return upstream.use_count() > 1;
+    }
+
+    void evict_idle() {
+        const auto now = clock::now();
+        std::erase_if(m_upstreams, [&](const auto &entry) {
+            const auto &upstream = entry.second;
+            return !in_use(upstream) && now - upstream->last_used >= m_config.idle_timeout;
+        });
+        m_size.set(static_cast<int64_t>(m_upstreams.size()));
+    }
+
+    bool evict_least_recent() {
+        auto oldest = m_upstreams.end();
+        for(auto it = m_upstreams.begin(); it != m_upstreams.end(); ++it) {
+            if(in_use(it->second)) {
+                continue;
+            }
+            if(oldest == m_upstreams.end() ||
+               it->second->last_used < oldest->second->last_used) {
+                oldest = it;
+            }
+        }
+        if(oldest == m_upstreams.end()) {
+            return false;
+        }
+
+        spdlog::info("dropping state of upstream {} to make room", oldest->first);
+        m_upstreams.erase(oldest);
+        m_size.set(static_cast<int64_t>(m_upstreams.size()));
+        return true;
+    }
+
+    const UpstreamConfig m_config;
+    metrics::Gauge &m_size;
+    std::unordered_map<std::string, std::shared_ptr<Upstream>> m_upstreams;
+};
+
+#endif
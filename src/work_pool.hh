@@ -0,0 +1,280 @@
+#ifndef WORK_POOL_HH_
+#define WORK_POOL_HH_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include "metrics.hh"
+#include "options.hh"
+
+struct WorkPoolConfig {
+    // Threads kept running; defaults to the number of cores
+    size_t min_threads = std::max(1u, std::thread::hardware_concurrency());
+    // Threads started at most while jobs are queued
+    size_t max_threads = 4 * min_threads;
+    // Time an extra thread stays idle before it exits
+    std::chrono::steady_clock::duration idle_timeout = std::chrono::seconds(10);
+
+    static WorkPoolConfig from_options(const Options &options) {
+        WorkPoolConfig config;
+        config.min_threads = options.get("work-threads", config.min_threads);
+        config.max_threads = options.get("work-threads-max", 4 * config.min_threads);
+        config.idle_timeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(options.get("work-idle-timeout", 10.0)));
+
+        if(config.min_threads == 0 || config.max_threads < config.min_threads) {
+            throw std::invalid_argument {
+                "--work-threads*: expected 1 <= work-threads <= work-threads-max"};
+        }
+        return config;
+    }
+};
+
+// Thread pool for blocking or CPU-bound jobs, growing from `min_threads`
+// up to `max_threads` while jobs are queued and shrinking back once the
+// extra threads have been idle for `idle_timeout`.
+//
+// Every thread has its own job deque, so threads don't contend on a
+// single queue: jobs are spread round robin over the deques of running
+// threads, a thread runs the jobs of its own deque oldest first and steals
+// from the others when it runs dry. The thread counts are atomics, so
+// submitting a job takes the pool lock only to wake an idle thread or to
+// start one, and reading them never does.
+class WorkPool {
+public:
+    WorkPool(const WorkPoolConfig &config, metrics::Gauge &thread_gauge):
+        m_config {config}, m_thread_gauge {thread_gauge}, m_slots(config.max_threads) {
+        std::lock_guard lock {m_mutex};
+        while(m_threads < m_config.min_threads) {
+            start_thread();
+        }
+    }
+
+    WorkPool(const WorkPool &) = delete;
+    WorkPool &operator=(const WorkPool &) = delete;
+
+    // Finishes the queued jobs, then stops the threads
+    ~WorkPool() {
+        {
+            std::lock_guard lock {m_mutex};
+            m_stopping = true;
+        }
+        m_wakeup.notify_all();
+        for(auto &slot : m_slots) {
+            if(slot.thread.joinable()) {
+                slot.thread.join();
+            }
+        }
+    }
+
+    // Run `fn` on a pool thread and resume the calling coroutine on its
+    // own executor with the result, or the exception thrown by `fn`.
+    // `fn` must return a value.
+    template <typename Fn>
+    boost::asio::awaitable<std::invoke_result_t<Fn &>> run(Fn fn) {
+        using Result = std::invoke_result_t<Fn &>;
+        auto ex = co_await boost::asio::this_coro::executor;
+
+        // Named: GCC 12 destroys lambda temporaries of a co_await
+        // expression twice
+        const auto initiate = [this, ex](auto handler, Fn fn) {
+            submit([handler = std::move(handler), fn = std::move(fn),
+                    work = boost::asio::make_work_guard(ex)]() mutable {
+                std::exception_ptr error;
+                Result result {};
+                try {
+                    result = fn();
+                } catch(...) {
+                    error = std::current_exception();
+                }
+                boost::asio::post(work.get_executor(),
+                                  [handler = std::move(handler), error,
+                                   result = std::move(result)]() mutable {
+                                      std::move(handler)(error, std::move(result));
+                                  });
+            });
+        };
+        co_return co_await boost::asio::async_initiate<
+            const boost::asio::use_awaitable_t<>, void(std::exception_ptr, Result)>(
+            initiate, boost::asio::use_awaitable, std::move(fn));
+    }
+
+    // Jobs waiting for a thread
+    size_t queued() const {
+        return m_queued.load(std::memory_order_relaxed);
+    }
+
+    size_t threads() const {
+        return m_threads.load(std::memory_order_relaxed);
+    }
+
+private:
+    // Type-erased move-only job
+    class Job {
+    public:
+        virtual ~Job() = default;
+        virtual void run() = 0;
+    };
+
+    template <typename Fn>
+    class JobImpl: public Job {
+    public:
+        explicit JobImpl(Fn fn): m_fn {std::move(fn)} {}
+        void run() override {
+            m_fn();
+        }
+
+    private:
+        Fn m_fn;
+    };
+
+    struct Slot {
+        std::mutex mutex;
+        std::deque<std::unique_ptr<Job>> jobs;
+        std::atomic<bool> running {false};
+        std::thread thread;
+    };
+
+    template <typename Fn>
+    void submit(Fn fn) {
+        auto job = std::make_unique<JobImpl<Fn>>(std::move(fn));
+
+        // Next running thread, round robin. Jobs landing on a thread that
+        // is just exiting are stolen by the others.
+        auto &slot = m_slots[next_slot()];
+        {
+            std::lock_guard lock {slot.mutex};
+            slot.jobs.push_back(std::move(job));
+        }
+        m_queued.fetch_add(1);
+
+        // Threads check m_queued after counting themselves idle and before
+        // exiting, so with none idle and all running, one of them takes
+        // the job without being woken
+        if(m_idle == 0 && m_threads >= m_config.max_threads) {
+            return;
+        }
+        std::lock_guard lock {m_mutex};
+        if(m_idle > 0) {
+            m_wakeup.notify_one();
+        } else if(m_threads < m_config.max_threads) {
+            start_thread();
+        }
+    }
+
+    size_t next_slot() {
+        const auto start = m_next.fetch_add(1, std::memory_order_relaxed);
+        for(size_t i = 0; i < m_slots.size(); ++i) {
+            const auto index = (start + i) % m_slots.size();
+            if(m_slots[index].running.load(std::memory_order_relaxed)) {
+                return index;
+            }
+        }
+        return start % m_slots.size();
+    }
+
+    // Oldest job of slot `index`, else one stolen from another slot
+    std::unique_ptr<Job> take(size_t index) {
+        for(size_t i = 0; i < m_slots.size(); ++i) {
+            auto &slot = m_slots[(index + i) % m_slots.size()];
+            std::lock_guard lock {slot.mutex};
+            if(!slot.jobs.empty()) {
+                auto job = std::move(slot.jobs.front());
+                slot.jobs.pop_front();
+                m_queued.fetch_sub(1);
+                return job;
+            }
+        }
+        return nullptr;
+    }
+
+    // Start a thread in a free slot. Called with the pool lock held.
+    void start_thread() {
+        for(size_t index = 0; index < m_slots.size(); ++index) {
+            auto &slot = m_slots[index];
+            if(slot.running) {
+                continue;
+            }
+            // A thread that exited may still be finishing up
+            if(slot.thread.joinable()) {
+                slot.thread.join();
+            }
+            slot.running = true;
+            slot.thread = std::thread {[this, index] { worker(index); }};
+            ++m_threads;
+            m_thread_gauge.set(static_cast<int64_t>(m_threads));
+            return;
+        }
+    }
+
+    void worker(size_t index) {
+        for(;;) {
+            if(auto job = take(index)) {
+                job->run();
+                continue;
+            }
+
+            std::unique_lock lock {m_mutex};
+            if(m_queued > 0) {
+                continue;
+            }
+            if(m_stopping) {
+                break;
+            }
+
+            ++m_idle;
+            const auto woken = m_wakeup.wait_for(lock, m_config.idle_timeout, [this] {
+                return m_queued > 0 || m_stopping;
+            });
+            --m_idle;
+
+            if(!woken && m_threads > m_config.min_threads) {
+                // A job submitted meanwhile may have counted on this thread
+                // without taking the lock, so check again once uncounted
+                --m_threads;
+                if(m_queued > 0) {
+                    ++m_threads;
+                    continue;
+                }
+                m_slots[index].running = false;
+                m_thread_gauge.set(static_cast<int64_t>(m_threads));
+                return;
+            }
+        }
+    }
+
+    const WorkPoolConfig m_config;
+    metrics::Gauge &m_thread_gauge;
+
+    std::vector<Slot> m_slots;
+    std::atomic<size_t> m_next {0};
+    std::atomic<size_t> m_queued {0};
+
+    // Starting, parking and stopping threads happen under the lock
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    std::atomic<size_t> m_threads {0};
+    std::atomic<size_t> m_idle {0};
+    bool m_stopping = false;
+};
+
+#endif
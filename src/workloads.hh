@@ -0,0 +1,221 @@
+#ifndef WORKLOADS_HH_
+#define WORKLOADS_HH_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stop_token>
+#include <vector>
+
+// CPU-bound jobs for sleepy-server, each in a scalar and a SIMD variant.
+// Both variants run the same algorithm in the same loop order and give
+// the same result; they differ only in vectorization. The SIMD variants
+// use GCC vector extensions, so they compile to whatever vector
+// instructions the target has (SSE2 on plain x86-64, AVX2 with
+// -march=native), and the scalar ones are kept from being auto-vectorized.
+// Jobs check their stop token between chunks of work and return nothing
+// when stopped.
+namespace workloads {
+
+namespace detail {
+
+using u32x8 = uint32_t __attribute__((vector_size(32)));
+using f32x8 = float __attribute__((vector_size(32)));
+
+// Lanes of a vector
+constexpr size_t lanes = 8;
+// Interleaved lanes of the hash, enough independent multiplies to keep
+// scalar and vector multipliers busy
+constexpr size_t hash_lanes = 4 * lanes;
+
+constexpr uint32_t fnv_prime = 0x01000193;
+constexpr uint32_t fnv_offset = 0x811c9dc5;
+
+// Bytes hashed between stop checks
+constexpr size_t hash_chunk = 64 * 1024;
+
+// Pseudo-random input, the same for every job
+inline const std::vector<uint32_t> &
+hash_input() {
+    static const auto input = [] {
+        std::vector<uint32_t> words(hash_chunk / sizeof(uint32_t));
+        uint32_t x = 2463534242;
+        for(auto &w : words) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            w = x;
+        }
+        return words;
+    }();
+    return input;
+}
+
+} // namespace detail
+
+// FNV-1a over 32-bit words of `size` bytes of data, as 32 interleaved
+// lanes (word i goes to lane i % 32) folded together at the end. One word
+// at a time.
+__attribute__((optimize("no-tree-vectorize"))) inline std::optional<uint32_t>
+hash_scalar(size_t size, std::stop_token stop) {
+    const auto &input = detail::hash_input();
+    uint32_t h[detail::hash_lanes];
+    for(auto &lane : h) {
+        lane = detail::fnv_offset;
+    }
+
+    for(size_t done = 0; done < size; done += detail::hash_chunk) {
+        if(stop.stop_requested()) {
+            return std::nullopt;
+        }
+        for(size_t i = 0; i < input.size(); i += detail::hash_lanes) {
+            for(size_t lane = 0; lane < detail::hash_lanes; ++lane) {
+                h[lane] = (h[lane] ^ input[i + lane]) * detail::fnv_prime;
+            }
+        }
+    }
+
+    uint32_t result = detail::fnv_offset;
+    for(const auto lane : h) {
+        result = (result ^ lane) * detail::fnv_prime;
+    }
+    return result;
+}
+
+// Same hash, 8 lanes at a time
+inline std::optional<uint32_t>
+hash_simd(size_t size, std::stop_token stop) {
+    constexpr auto vectors = detail::hash_lanes / detail::lanes;
+    const auto &input = detail::hash_input();
+    detail::u32x8 h[vectors];
+    for(auto &v : h) {
+        v = detail::u32x8 {} + detail::fnv_offset;
+    }
+
+    for(size_t done = 0; done < size; done += detail::hash_chunk) {
+        if(stop.stop_requested()) {
+            return std::nullopt;
+        }
+        for(size_t i = 0; i < input.size(); i += detail::hash_lanes) {
+            for(size_t v = 0; v < vectors; ++v) {
+                detail::u32x8 w;
+                std::memcpy(&w, &input[i + v * detail::lanes], sizeof(w));
+                h[v] = (h[v] ^ w) * detail::fnv_prime;
+            }
+        }
+    }
+
+    uint32_t result = detail::fnv_offset;
+    for(const auto &v : h) {
+        for(size_t lane = 0; lane < detail::lanes; ++lane) {
+            result = (result ^ v[lane]) * detail::fnv_prime;
+        }
+    }
+    return result;
+}
+
+// Square matrices of floats, `n` by `n`, rows padded to whole vectors
+class Matrix {
+public:
+    explicit Matrix(size_t n):
+        m_n {n}, m_stride {(n + detail::lanes - 1) / detail::lanes * detail::lanes},
+        m_data(n * m_stride) {}
+
+    size_t size() const {
+        return m_n;
+    }
+
+    float *row(size_t i) {
+        return &m_data[i * m_stride];
+    }
+
+    const float *row(size_t i) const {
+        return &m_data[i * m_stride];
+    }
+
+    size_t stride() const {
+        return m_stride;
+    }
+
+    // Deterministic values in [-1, 1)
+    static Matrix sample(size_t n, uint32_t seed) {
+        Matrix m {n};
+        for(size_t i = 0; i < n; ++i) {
+            for(size_t j = 0; j < n; ++j) {
+                seed = seed * 1664525 + 1013904223;
+                m.row(i)[j] = static_cast<float>(seed >> 8) / (1 << 23) - 1;
+            }
+        }
+        return m;
+    }
+
+    // Sum of all elements, as a checksum of a result
+    double sum() const {
+        double s = 0;
+        for(size_t i = 0; i < m_n; ++i) {
+            for(size_t j = 0; j < m_n; ++j) {
+                s += row(i)[j];
+            }
+        }
+        return s;
+    }
+
+private:
+    size_t m_n;
+    size_t m_stride;
+    std::vector<float> m_data;
+};
+
+// Row by row product: each row of the result accumulates rows of `b`
+// scaled by an element of `a`, one column at a time
+__attribute__((optimize("no-tree-vectorize"))) inline std::optional<Matrix>
+matmul_scalar(const Matrix &a, const Matrix &b, std::stop_token stop) {
+    const auto n = a.size();
+    Matrix c {n};
+
+    for(size_t i = 0; i < n; ++i) {
+        if(stop.stop_requested()) {
+            return std::nullopt;
+        }
+        auto *out = c.row(i);
+        for(size_t k = 0; k < n; ++k) {
+            const auto scale = a.row(i)[k];
+            const auto *in = b.row(k);
+            for(size_t j = 0; j < c.stride(); ++j) {
+                out[j] += scale * in[j];
+            }
+        }
+    }
+    return c;
+}
+
+// Same product, 8 columns at a time
+inline std::optional<Matrix>
+matmul_simd(const Matrix &a, const Matrix &b, std::stop_token stop) {
+    const auto n = a.size();
+    Matrix c {n};
+
+    for(size_t i = 0; i < n; ++i) {
+        if(stop.stop_requested()) {
+            return std::nullopt;
+        }
+        auto *out = c.row(i);
+        for(size_t k = 0; k < n; ++k) {
+            const auto scale = a.row(i)[k];
+            const auto *in = b.row(k);
+            for(size_t j = 0; j < c.stride(); j += detail::lanes) {
+                detail::f32x8 x, y;
+                std::memcpy(&x, in + j, sizeof(x));
+                std::memcpy(&y, out + j, sizeof(y));
+                y += scale * x;
+                std::memcpy(out + j, &y, sizeof(y));
+            }
+        }
+    }
+    return c;
+}
+
+} // namespace workloads
+
+#endif
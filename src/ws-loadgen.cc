@@ -0,0 +1,402 @@
+#if defined(__clang__)
+#include <experimental/coroutine>
+#elif defined(__GNUC__)
+#include <coroutine>
+#endif
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/experimental/channel.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/websocket.hpp>
+
+#include "spdlog/fmt/ostr.h"
+#include "spdlog/spdlog.h"
+
+#include "happy_eyeballs.hh"
+#include "metrics.hh"
+#include "options.hh"
+#include "socket_options.hh"
+
+// Open-loop load generator for websocket-proxy.
+//
+// Batches are scheduled at a fixed rate regardless of how fast the proxy
+// answers, and latency is measured from the time a batch was *supposed*
+// to be sent. A stalled proxy therefore shows up in the latency
+// distribution instead of silently lowering the request rate (coordinated
+// omission). Every connection pipelines its batches, tagged with `#<id>`,
+// so a slow reply doesn't hold up the next send; sends that still fall
+// behind schedule are reported as late.
+
+namespace beast = boost::beast;
+namespace net = boost::asio;
+namespace this_coro = boost::asio::this_coro;
+namespace websocket = beast::websocket;
+namespace logging = spdlog;
+
+using boost::system::error_code;
+using clock_type = std::chrono::steady_clock;
+using net::experimental::channel;
+using net::ip::tcp;
+
+// Intended send times of the batches assigned to a connection
+using schedule_channel = channel<void(error_code, clock_type::time_point)>;
+
+// Delay after the intended send time from which a send counts as late
+constexpr int64_t late_send_us = 1000;
+
+struct LoadgenConfig {
+    std::string host = "127.0.0.1";
+    std::string port = "8082";
+    size_t connections = 10;
+    double rate = 100;     // batches per second, over all connections
+    double duration = 10;  // seconds
+    size_t batch_size = 1; // URLs per batch
+    std::vector<std::string> urls {"http://localhost:8081/0.1"};
+    uint64_t seed = 1;
+    double drain_timeout = 30; // seconds to wait for replies after the schedule ends
+    SocketOptions sockets;
+
+    static LoadgenConfig from_options(const Options &options) {
+        LoadgenConfig config;
+        config.host = options.get("host", config.host);
+        config.port = options.get("port", config.port);
+        config.connections = options.get("connections", config.connections);
+        config.rate = options.get("rate", config.rate);
+        config.duration = options.get("duration", config.duration);
+        config.batch_size = options.get("batch-size", config.batch_size);
+        config.seed = options.get("seed", config.seed);
+        config.drain_timeout = options.get("drain-timeout", config.drain_timeout);
+        config.sockets = SocketOptions::from_options(options);
+
+        if(options.has("urls")) {
+            config.urls.clear();
+            boost::split(config.urls, options.get("urls", ""), boost::is_any_of(","),
+                         boost::token_compress_on);
+        }
+
+        if(config.connections == 0 || config.rate <= 0 || config.batch_size == 0 ||
+           config.urls.empty()) {
+            throw std::invalid_argument {"--connections, --rate, --batch-size and --urls "
+                                         "must be positive"};
+        }
+        return config;
+    }
+};
+
+struct LoadgenStats {
+    size_t active_connections = 0;
+    size_t sent = 0;
+    size_t answered = 0;
+    size_t completed = 0;  // answered batches that were not refused
+    size_t refused = 0;    // batches answered with Error(...)
+    size_t failed = 0;     // batches that could not be sent
+    size_t url_errors = 0; // Err(...) lines in replies
+    size_t late = 0;       // batches sent more than late_send_us behind schedule
+    uint64_t max_us = 0;
+    uint64_t max_late_us = 0;
+    metrics::Histogram latency;
+};
+
+// Build the text of the next batch from the configured URL mix
+std::string
+make_batch(const LoadgenConfig &config, std::mt19937_64 &rng) {
+    std::uniform_int_distribution<size_t> pick {0, config.urls.size() - 1};
+    std::string batch;
+
+    for(size_t i = 0; i < config.batch_size; ++i) {
+        if(i) {
+            batch += ' ';
+        }
+        batch += config.urls[pick(rng)];
+    }
+    return batch;
+}
+
+// A connection to the proxy. Batches are sent on schedule without waiting
+// for the replies to earlier ones, which are matched by the `#<id>` token
+// of the message.
+struct Connection {
+    explicit Connection(net::any_io_executor ex): ws {ex}, idle {ex} {}
+
+    websocket::stream<beast::tcp_stream> ws;
+    // Intended send times of the batches awaiting their reply, by id
+    std::unordered_map<uint64_t, clock_type::time_point> outstanding;
+    // Cancelled once no more replies are expected
+    net::steady_timer idle;
+    bool sending = true;
+    bool reading = true;
+};
+
+// Tally a reply `latency` after the intended send time of its batch
+void
+account(LoadgenStats &stats, const std::string &reply, clock_type::duration latency) {
+    ++stats.answered;
+
+    // The proxy refused the whole batch (over a limit): a failure, and its
+    // quick reply must not count as latency
+    if(reply.find("\nError(") != std::string::npos) {
+        ++stats.refused;
+        return;
+    }
+
+    const auto us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    stats.latency.observe_us(us);
+    stats.max_us = std::max<uint64_t>(stats.max_us, us);
+    ++stats.completed;
+
+    for(size_t pos = reply.find("Err("); pos != std::string::npos;
+        pos = reply.find("Err(", pos + 1)) {
+        ++stats.url_errors;
+    }
+}
+
+// Id of the batch a reply answers, from its leading "#<id>" line
+std::optional<uint64_t>
+reply_id(const std::string &reply) {
+    uint64_t id = 0;
+    if(!reply.starts_with('#') ||
+       std::from_chars(reply.data() + 1, reply.data() + reply.size(), id).ec != std::errc {}) {
+        return std::nullopt;
+    }
+    return id;
+}
+
+// Read replies until the connection is closed
+net::awaitable<void>
+read_replies(std::shared_ptr<Connection> conn, LoadgenStats &stats, size_t id) {
+    try {
+        for(;;) {
+            beast::flat_buffer buffer;
+            co_await conn->ws.async_read(buffer, net::use_awaitable);
+            const auto now = clock_type::now();
+            const auto reply = beast::buffers_to_string(buffer.data());
+
+            const auto batch = reply_id(reply);
+            const auto it = batch ? conn->outstanding.find(*batch) : conn->outstanding.end();
+            if(it == conn->outstanding.end()) {
+                logging::warn("connection {} got a reply to no batch: '{}'", id,
+                              reply.substr(0, reply.find('\n')));
+                continue;
+            }
+
+            account(stats, reply, now - it->second);
+            conn->outstanding.erase(it);
+            if(!conn->sending && conn->outstanding.empty()) {
+                conn->idle.cancel();
+            }
+        }
+    } catch(const std::exception &e) {
+        if(conn->sending || !conn->outstanding.empty()) {
+            logging::error("connection {} got exception {}", id, e.what());
+        }
+    }
+
+    conn->reading = false;
+    conn->idle.cancel();
+}
+
+net::awaitable<void>
+connection(const LoadgenConfig &config, LoadgenStats &stats, schedule_channel &schedule,
+           net::steady_timer &drain, size_t id) {
+    auto ex = co_await this_coro::executor;
+    std::mt19937_64 rng {config.seed + id};
+
+    try {
+        tcp::resolver resolver {ex};
+        auto conn = std::make_shared<Connection>(ex);
+        auto &ws = conn->ws;
+
+        const auto results =
+            co_await resolver.async_resolve(config.host, config.port, net::use_awaitable);
+        co_await happy_eyeballs::async_connect(
+            beast::get_lowest_layer(ws).socket(), results, std::chrono::seconds(30),
+            [&](tcp::socket &socket) {
+                socket_options::apply_upstream(socket, config.sockets);
+            });
+
+        beast::get_lowest_layer(ws).expires_never();
+        ws.set_option(websocket::stream_base::timeout::suggested(beast::role_type::client));
+        co_await ws.async_handshake(config.host + ":" + config.port, "/", net::use_awaitable);
+
+        net::co_spawn(ex, read_replies(conn, stats, id), net::detached);
+
+        for(uint64_t batch = 1;; ++batch) {
+            error_code ec;
+            const auto intended =
+                co_await schedule.async_receive(net::redirect_error(net::use_awaitable, ec));
+            if(ec) {
+                // The schedule is over
+                break;
+            }
+            if(!conn->reading) {
+                throw std::runtime_error {"connection lost"};
+            }
+
+            // Sends fall behind schedule while the previous ones are stuck,
+            // e.g. because the proxy stopped reading
+            const auto behind = std::chrono::duration_cast<std::chrono::microseconds>(
+                                    clock_type::now() - intended)
+                                    .count();
+            if(behind > late_send_us) {
+                ++stats.late;
+                stats.max_late_us = std::max<uint64_t>(stats.max_late_us, behind);
+            }
+
+            // Counted as sent first, so that a failed write counts as unanswered
+            const auto message = fmt::format("#{} {}", batch, make_batch(config, rng));
+            conn->outstanding.emplace(batch, intended);
+            ++stats.sent;
+            co_await ws.async_write(net::buffer(message), net::use_awaitable);
+        }
+
+        // Wait for the remaining replies
+        conn->sending = false;
+        if(conn->reading && !conn->outstanding.empty()) {
+            error_code ec;
+            conn->idle.expires_at(clock_type::time_point::max());
+            co_await conn->idle.async_wait(net::redirect_error(net::use_awaitable, ec));
+        }
+        if(!conn->reading) {
+            throw std::runtime_error {"connection lost"};
+        }
+
+        co_await ws.async_close(websocket::close_code::normal, net::use_awaitable);
+    } catch(const std::exception &e) {
+        logging::error("connection {} got exception {}", id, e.what());
+
+        // Everything queued for this connection is lost
+        while(schedule.try_receive([&](error_code, clock_type::time_point) {
+            ++stats.failed;
+        })) {
+        }
+        schedule.close();
+    }
+
+    if(--stats.active_connections == 0) {
+        drain.cancel();
+    }
+}
+
+// Hand out batches to the connections at a fixed rate
+net::awaitable<void>
+scheduler(net::io_context &ioc, const LoadgenConfig &config, LoadgenStats &stats,
+          std::vector<std::unique_ptr<schedule_channel>> &chans, net::steady_timer &drain) {
+    net::steady_timer timer {ioc};
+    const auto interval = std::chrono::duration_cast<clock_type::duration>(
+        std::chrono::duration<double>(1.0 / config.rate));
+    const auto n = static_cast<size_t>(config.rate * config.duration);
+    const auto start = clock_type::now();
+
+    for(size_t i = 0; i < n; ++i) {
+        const auto intended = start + i * interval;
+        timer.expires_at(intended);
+        co_await timer.async_wait(net::use_awaitable);
+
+        if(!chans[i % chans.size()]->try_send(error_code {}, intended)) {
+            ++stats.failed;
+        }
+    }
+
+    for(auto &chan : chans) {
+        chan->close();
+    }
+
+    // Give outstanding batches some time to complete, then give up on them
+    if(stats.active_connections > 0) {
+        error_code ec;
+        drain.expires_after(std::chrono::duration_cast<clock_type::duration>(
+            std::chrono::duration<double>(config.drain_timeout)));
+        co_await drain.async_wait(net::redirect_error(net::use_awaitable, ec));
+        if(!ec) {
+            logging::warn("{} batches unanswered, stopping", stats.sent - stats.answered);
+            ioc.stop();
+        }
+    }
+}
+
+void
+report(const LoadgenConfig &config, const LoadgenStats &stats, clock_type::duration elapsed) {
+    const auto seconds = std::chrono::duration<double>(elapsed).count();
+    const auto ms = [](uint64_t us) { return us / 1000.0; };
+
+    fmt::print("target:      ws://{}:{}, {} connections, {} batches/s, {} URLs per batch\n",
+               config.host, config.port, config.connections, config.rate, config.batch_size);
+    fmt::print("duration:    {:.3f} s\n", seconds);
+    fmt::print("batches:     {} sent, {} completed, {} refused, {} failed\n", stats.sent,
+               stats.completed, stats.refused, stats.failed + stats.sent - stats.answered);
+    fmt::print("URL errors:  {}\n", stats.url_errors);
+    fmt::print("late sends:  {} (over {} ms behind schedule, at most {:.3f} ms)\n", stats.late,
+               ms(late_send_us), ms(stats.max_late_us));
+    fmt::print("throughput:  {:.1f} batches/s, {:.1f} URLs/s\n", stats.completed / seconds,
+               stats.completed * config.batch_size / seconds);
+
+    fmt::print("\nlatency (from intended send time):\n");
+    fmt::print("{:>12} {:>14} {:>12}\n", "percentile", "value (ms)", "count");
+    for(const auto q : {0.5, 0.75, 0.9, 0.99, 0.999, 0.9999}) {
+        fmt::print("{:>11.2f}% {:>14.3f} {:>12}\n", q * 100, ms(stats.latency.quantile_us(q)),
+                   static_cast<uint64_t>(q * stats.completed));
+    }
+    fmt::print("{:>11.2f}% {:>14.3f} {:>12}\n", 100.0, ms(stats.max_us), stats.completed);
+}
+
+int
+main(int argc, char **argv) {
+    net::io_context ioc;
+    LoadgenConfig config;
+
+    try {
+        const Options options {argc, argv};
+        config = LoadgenConfig::from_options(options);
+        options.reject_unknown();
+    } catch(const std::exception &e) {
+        logging::error("{}", e.what());
+        return EXIT_FAILURE;
+    }
+
+    LoadgenStats stats;
+    net::steady_timer drain {ioc};
+    const auto per_connection =
+        static_cast<size_t>(config.rate * config.duration) / config.connections + 1;
+
+    std::vector<std::unique_ptr<schedule_channel>> chans;
+    stats.active_connections = config.connections;
+    for(size_t i = 0; i < config.connections; ++i) {
+        chans.push_back(
+            std::make_unique<schedule_channel>(ioc.get_executor(), per_connection));
+        net::co_spawn(ioc, connection(config, stats, *chans.back(), drain, i), net::detached);
+    }
+
+    const auto start = clock_type::now();
+    net::co_spawn(ioc, scheduler(ioc, config, stats, chans, drain), net::detached);
+
+    ioc.run();
+
+    report(config, stats, clock_type::now() - start);
+    return stats.failed == 0 && stats.refused == 0 && stats.sent == stats.completed
+               ? EXIT_SUCCESS
+               : EXIT_FAILURE;
+}
@@ -0,0 +1,146 @@
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/this_coro.hpp>
+
+#include "adaptive_limit.hh"
+#include "check.hh"
+
+namespace net = boost::asio;
+using namespace std::chrono_literals;
+
+using Tokens = std::vector<AdaptiveLimiter::Token>;
+
+AdaptiveLimitConfig
+config(double initial, double min = 1, double max = 1000) {
+    AdaptiveLimitConfig config;
+    config.initial = initial;
+    config.min = min;
+    config.max = max;
+    return config;
+}
+
+// Complete `n` fetches of `latency` while `held` slots stay in use, each
+// followed by a new one
+net::awaitable<void>
+cycle(AdaptiveLimiter &limiter, Tokens &held, size_t n,
+      AdaptiveLimiter::clock::duration latency) {
+    for(size_t i = 0; i < n; ++i) {
+        held.front().success(latency);
+        held.erase(held.begin());
+        held.push_back(co_await limiter.acquire());
+    }
+}
+
+net::awaitable<void>
+take_slot(AdaptiveLimiter &limiter, Tokens &held) {
+    held.push_back(co_await limiter.acquire());
+}
+
+net::awaitable<void>
+grows_while_latency_is_flat() {
+    AdaptiveLimiter limiter {config(10)};
+    Tokens held;
+    for(int i = 0; i < 10; ++i) {
+        held.push_back(co_await limiter.acquire());
+    }
+
+    co_await cycle(limiter, held, 20, 10ms);
+    CHECK(limiter.limit() > 10);
+}
+
+net::awaitable<void>
+idle_limit_does_not_grow() {
+    AdaptiveLimiter limiter {config(10)};
+    Tokens held;
+    held.push_back(co_await limiter.acquire());
+
+    co_await cycle(limiter, held, 20, 10ms);
+    CHECK(limiter.limit() == 10);
+}
+
+net::awaitable<void>
+backs_off_on_latency_spike() {
+    AdaptiveLimiter limiter {config(10)};
+    Tokens held;
+    for(int i = 0; i < 10; ++i) {
+        held.push_back(co_await limiter.acquire());
+    }
+    co_await cycle(limiter, held, 20, 10ms);
+    const auto before = limiter.limit();
+
+    co_await cycle(limiter, held, 10, 100ms);
+    CHECK(limiter.limit() < before);
+}
+
+net::awaitable<void>
+backs_off_on_failure() {
+    AdaptiveLimiter limiter {config(10)};
+    auto token = co_await limiter.acquire();
+
+    token.failure();
+    CHECK(std::abs(limiter.limit() - 10 * AdaptiveLimitConfig {}.backoff) < 1e-9);
+}
+
+net::awaitable<void>
+limit_stays_within_bounds() {
+    AdaptiveLimiter shrinking {config(6, 5)};
+    for(int i = 0; i < 10; ++i) {
+        (co_await shrinking.acquire()).failure();
+    }
+    CHECK(shrinking.limit() == 5);
+
+    AdaptiveLimiter growing {config(10, 1, 12)};
+    Tokens held;
+    for(int i = 0; i < 10; ++i) {
+        held.push_back(co_await growing.acquire());
+    }
+    co_await cycle(growing, held, 20, 10ms);
+    CHECK(growing.limit() == 12);
+}
+
+// A rising limit lets as many waiters in as it has new room for
+net::awaitable<void>
+rising_limit_wakes_waiters() {
+    const auto ex = co_await net::this_coro::executor;
+    auto c = config(2);
+    c.smoothing = 1;
+    AdaptiveLimiter limiter {c};
+    Tokens held;
+    held.push_back(co_await limiter.acquire());
+    held.push_back(co_await limiter.acquire());
+
+    Tokens woken;
+    for(int i = 0; i < 3; ++i) {
+        net::co_spawn(ex, take_slot(limiter, woken), net::detached);
+    }
+    CHECK(!co_await wait_until([&] { return !woken.empty(); }, 50ms));
+
+    // The limit rises from 2 to 2 + sqrt(2): the slot handed back and a
+    // new one go to waiters
+    held.front().success(10ms);
+    CHECK(co_await wait_until([&] { return woken.size() == 2; }, 1s));
+    CHECK(limiter.limit() > 3 && limiter.limit() < 4);
+    CHECK(limiter.inflight() == 3);
+
+    held.clear();
+    CHECK(co_await wait_until([&] { return woken.size() == 3; }, 1s));
+    woken.clear();
+    CHECK(limiter.inflight() == 0);
+}
+
+int
+main() {
+    run_test("grows_while_latency_is_flat", grows_while_latency_is_flat());
+    run_test("idle_limit_does_not_grow", idle_limit_does_not_grow());
+    run_test("backs_off_on_latency_spike", backs_off_on_latency_spike());
+    run_test("backs_off_on_failure", backs_off_on_failure());
+    run_test("limit_stays_within_bounds", limit_stays_within_bounds());
+    run_test("rising_limit_wakes_waiters", rising_limit_wakes_waiters());
+    return exit_status();
+}
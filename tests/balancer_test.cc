@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include "balancer.hh"
+#include "check.hh"
+#include "metrics.hh"
+
+namespace net = boost::asio;
+using net::ip::tcp;
+using namespace std::chrono_literals;
+
+const tcp::endpoint a {net::ip::make_address("192.0.2.1"), 80};
+const tcp::endpoint b {net::ip::make_address("192.0.2.2"), 80};
+const tcp::endpoint c {net::ip::make_address("192.0.2.3"), 80};
+
+// Give `endpoint` a latency sample
+void
+sample(EndpointBalancer &balancer, const tcp::endpoint &endpoint) {
+    balancer.lease(endpoint).success(10ms);
+}
+
+void
+fail_connects(EndpointBalancer &balancer, const tcp::endpoint &endpoint, unsigned n) {
+    for(unsigned i = 0; i < n; ++i) {
+        balancer.report_connect(endpoint, net::error::connection_refused);
+    }
+}
+
+// Of two random endpoints, the one with fewer fetches in flight comes
+// first, so the busiest one never does
+net::awaitable<void>
+prefers_fewer_inflight() {
+    metrics::Counter ejections;
+    EndpointBalancer balancer {BalancerConfig {}, ejections};
+    for(const auto &endpoint : {a, b, c}) {
+        sample(balancer, endpoint);
+    }
+    std::vector<EndpointBalancer::Lease> busy;
+    for(int i = 0; i < 3; ++i) {
+        busy.push_back(balancer.lease(a));
+    }
+    busy.push_back(balancer.lease(b));
+
+    int b_first = 0;
+    int c_first = 0;
+    for(int i = 0; i < 100; ++i) {
+        const auto order = balancer.order({a, b, c});
+        CHECK(order.size() == 3);
+        CHECK(order.front() != a);
+        b_first += order.front() == b;
+        c_first += order.front() == c;
+    }
+    // c wins every pair it is part of, b only the one against a
+    CHECK(c_first > b_first);
+    CHECK(b_first > 0);
+    co_return;
+}
+
+// After `ejection_failures` failed connects in a row an endpoint goes last
+// until its ejection time is over
+net::awaitable<void>
+failing_endpoint_is_ejected_then_retried() {
+    BalancerConfig config;
+    config.ejection_failures = 3;
+    config.ejection_time = 50ms;
+    metrics::Counter ejections;
+    EndpointBalancer balancer {config, ejections};
+    // Unlike b, a has no latency sample and wins while it is not ejected
+    sample(balancer, b);
+
+    fail_connects(balancer, a, 2);
+    CHECK(ejections.value() == 0);
+    CHECK(balancer.order({a, b}).front() == a);
+
+    fail_connects(balancer, a, 1);
+    CHECK(ejections.value() == 1);
+    for(int i = 0; i < 10; ++i) {
+        CHECK(balancer.order({a, b}).back() == a);
+    }
+
+    net::steady_timer timer {co_await net::this_coro::executor, 60ms};
+    co_await timer.async_wait(net::use_awaitable);
+    CHECK(balancer.order({a, b}).front() == a);
+}
+
+// With every endpoint ejected, all of them are still tried
+net::awaitable<void>
+all_ejected_falls_back_to_every_endpoint() {
+    BalancerConfig config;
+    config.ejection_failures = 1;
+    metrics::Counter ejections;
+    EndpointBalancer balancer {config, ejections};
+    fail_connects(balancer, a, 1);
+    fail_connects(balancer, b, 1);
+    CHECK(ejections.value() == 2);
+
+    const std::vector<tcp::endpoint> endpoints {a, b};
+    const auto order = balancer.order(endpoints);
+    CHECK(order.size() == endpoints.size());
+    CHECK(std::is_permutation(order.begin(), order.end(), endpoints.begin()));
+    co_return;
+}
+
+int
+main() {
+    run_test("prefers_fewer_inflight", prefers_fewer_inflight());
+    run_test("failing_endpoint_is_ejected_then_retried",
+             failing_endpoint_is_ejected_then_retried());
+    run_test("all_ejected_falls_back_to_every_endpoint",
+             all_ejected_falls_back_to_every_endpoint());
+    return exit_status();
+}
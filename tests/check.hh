@@ -0,0 +1,78 @@
+#ifndef CHECK_HH_
+#define CHECK_HH_
+
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <utility>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include "spdlog/fmt/fmt.h"
+
+// Minimal test harness: CHECK() logs the conditions that don't hold, and a
+// test binary returns exit_status() from main().
+
+inline int &
+check_failures() {
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(cond)                                                                         \
+    do {                                                                                    \
+        if(!(cond)) {                                                                       \
+            fmt::print(stderr, "{}:{}: CHECK({}) failed\n", __FILE__, __LINE__, #cond);    \
+            ++check_failures();                                                             \
+        }                                                                                   \
+    } while(false)
+
+// Run the coroutine `test` to completion, counting an exception it throws
+// as a failure
+template <typename Awaitable>
+void
+run_test(const char *name, Awaitable test) {
+    const auto failures = check_failures();
+    boost::asio::io_context ioc;
+    boost::asio::co_spawn(ioc, std::move(test), [name](std::exception_ptr e) {
+        if(!e) {
+            return;
+        }
+        try {
+            std::rethrow_exception(e);
+        } catch(const std::exception &ex) {
+            fmt::print(stderr, "{}: unexpected exception: {}\n", name, ex.what());
+        }
+        ++check_failures();
+    });
+    ioc.run();
+    fmt::print("{}: {}\n", name, check_failures() == failures ? "ok" : "FAILED");
+}
+
+// Poll `done` until it holds, false if it still doesn't after `timeout`
+template <typename Predicate>
+boost::asio::awaitable<bool>
+wait_until(Predicate done, std::chrono::steady_clock::duration timeout) {
+    boost::asio::steady_timer timer {co_await boost::asio::this_coro::executor};
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while(!done()) {
+        if(std::chrono::steady_clock::now() >= deadline) {
+            co_return false;
+        }
+        timer.expires_after(std::chrono::milliseconds(10));
+        co_await timer.async_wait(boost::asio::use_awaitable);
+    }
+    co_return true;
+}
+
+inline int
+exit_status() {
+    return check_failures() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif
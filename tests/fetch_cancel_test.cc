@@ -0,0 +1,157 @@
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/websocket.hpp>
+
+#include "spdlog/spdlog.h"
+
+#include "cancellation.hh"
+#include "check.hh"
+#include "options.hh"
+#include "proxy_context.hh"
+#include "proxy_fetch.hh"
+#include "proxy_session.hh"
+#include "upstreams.hh"
+
+namespace beast = boost::beast;
+namespace net = boost::asio;
+namespace websocket = beast::websocket;
+using net::ip::tcp;
+using namespace std::chrono_literals;
+
+net::awaitable<void>
+fetch_batch(proxy::ProxyContext &ctx, const std::vector<std::string> urls) {
+    co_await proxy::http_get_multiple(ctx, ctx.scheduler.flow(1), urls);
+}
+
+// Connect a websocket client to a new session of the proxy. `ended` is set
+// once the session is over.
+net::awaitable<websocket::stream<tcp::socket>>
+connect_session(proxy::ProxyContext &ctx, std::shared_ptr<bool> ended) {
+    const auto ex = co_await net::this_coro::executor;
+    tcp::acceptor acceptor {ex, {net::ip::address_v4::loopback(), 0}};
+    websocket::stream<tcp::socket> client {ex};
+    co_await client.next_layer().async_connect(acceptor.local_endpoint(), net::use_awaitable);
+    auto socket = co_await acceptor.async_accept(net::use_awaitable);
+
+    auto connection = ctx.connections.add(socket.remote_endpoint().address());
+    net::co_spawn(ex,
+                  proxy::websocket_client(ctx, std::move(*connection),
+                                          websocket::stream<beast::tcp_stream> {
+                                              std::move(socket)}),
+                  [ended](std::exception_ptr) { *ended = true; });
+
+    co_await client.async_handshake("127.0.0.1", "/", net::use_awaitable);
+    co_return client;
+}
+
+// Drop the connection without a close handshake, like a client that
+// crashed
+void
+reset(websocket::stream<tcp::socket> &client) {
+    auto &socket = client.next_layer();
+    socket.set_option(net::socket_base::linger {true, 0});
+    socket.close();
+}
+
+// A batch abandoned by its client (its coroutine is cancelled) closes the
+// connections of its fetches instead of leaving them to the upstream
+net::awaitable<void>
+abandoned_batch_closes_upstream_sockets(proxy::ProxyContext &ctx) {
+    constexpr size_t n = 4;
+    const auto ex = co_await net::this_coro::executor;
+    SilentUpstream upstream {ex};
+    const std::vector<std::string> urls(n,
+                                        fmt::format("http://127.0.0.1:{}/", upstream.port()));
+
+    CancellationGroup batch;
+    net::co_spawn(ex, fetch_batch(ctx, urls), batch.token());
+    CHECK(co_await wait_until([&] { return upstream.open() == n; }, 2s));
+
+    batch.emit();
+    CHECK(co_await wait_until([&] { return upstream.open() == 0; }, 2s));
+
+    upstream.stop();
+}
+
+// A client that goes away takes the fetches of all its messages with it
+net::awaitable<void>
+client_reset_closes_upstream_sockets(proxy::ProxyContext &ctx) {
+    const auto ex = co_await net::this_coro::executor;
+    SilentUpstream upstream {ex};
+    const auto url = fmt::format("http://127.0.0.1:{}/", upstream.port());
+    auto ended = std::make_shared<bool>(false);
+    auto client = co_await connect_session(ctx, ended);
+
+    for(int id = 1; id <= 2; ++id) {
+        const auto message = fmt::format("#{} {} {}", id, url, url);
+        co_await client.async_write(net::buffer(message), net::use_awaitable);
+    }
+    CHECK(co_await wait_until([&] { return upstream.open() == 4; }, 2s));
+
+    reset(client);
+    CHECK(co_await wait_until([&] { return upstream.open() == 0; }, 1s));
+    CHECK(co_await wait_until([&] { return *ended; }, 1s));
+
+    upstream.stop();
+}
+
+// Same, for a client with more messages than the session processes at a
+// time: the reader is waiting for a slot instead of reading
+net::awaitable<void>
+client_reset_at_inflight_cap_closes_upstream_sockets(proxy::ProxyContext &ctx) {
+    const auto ex = co_await net::this_coro::executor;
+    SilentUpstream upstream {ex};
+    const auto url = fmt::format("http://127.0.0.1:{}/", upstream.port());
+    auto ended = std::make_shared<bool>(false);
+    auto client = co_await connect_session(ctx, ended);
+
+    const auto cap = ctx.config.session_max_inflight;
+    for(size_t id = 1; id <= cap + 2; ++id) {
+        const auto message = fmt::format("#{} {}", id, url);
+        co_await client.async_write(net::buffer(message), net::use_awaitable);
+    }
+    CHECK(co_await wait_until([&] { return upstream.open() == cap; }, 2s));
+    // Let the reader get to the next message and wait for a slot
+    net::steady_timer settle {ex, 100ms};
+    co_await settle.async_wait(net::use_awaitable);
+    CHECK(upstream.open() == cap);
+
+    reset(client);
+    CHECK(co_await wait_until([&] { return upstream.open() == 0; }, 1s));
+    CHECK(co_await wait_until([&] { return *ended; }, 1s));
+
+    upstream.stop();
+}
+
+int
+main() {
+    spdlog::set_level(spdlog::level::off);
+
+    // Sessions may outlive a failed test until their fetches time out
+    const auto config = proxy::ProxyConfig::from_options(Options {});
+    proxy::ProxyContext ctx {config};
+    auto capped_config = config;
+    capped_config.session_max_inflight = 2;
+    proxy::ProxyContext capped_ctx {capped_config};
+
+    run_test("abandoned_batch_closes_upstream_sockets",
+             abandoned_batch_closes_upstream_sockets(ctx));
+    run_test("client_reset_closes_upstream_sockets",
+             client_reset_closes_upstream_sockets(ctx));
+    run_test("client_reset_at_inflight_cap_closes_upstream_sockets",
+             client_reset_at_inflight_cap_closes_upstream_sockets(capped_ctx));
+    return exit_status();
+}
@@ -0,0 +1,71 @@
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/this_coro.hpp>
+
+#include "spdlog/spdlog.h"
+
+#include "check.hh"
+#include "options.hh"
+#include "proxy_context.hh"
+#include "proxy_fetch.hh"
+#include "proxy_protocol.hh"
+#include "upstreams.hh"
+
+namespace net = boost::asio;
+using namespace std::chrono_literals;
+
+// Concurrency limit of the upstream, the bottleneck of the tests
+constexpr size_t upstream_limit = 2;
+
+// Two clients fetch from the same upstream. The second one's small batch
+// waits for a turn or two of the first one, not behind its large batch.
+net::awaitable<void>
+small_batch_is_not_stuck_behind_large_one(proxy::ProxyContext &ctx) {
+    const auto ex = co_await net::this_coro::executor;
+    SlowUpstream upstream {ex, 20ms};
+    const auto url = fmt::format("http://127.0.0.1:{}/", upstream.port());
+    const std::vector<std::string> large(40, url + "large");
+    const std::vector<std::string> small(2, url + "small");
+
+    auto done = std::make_shared<size_t>(0);
+    const auto count_done = [done](std::exception_ptr, std::vector<FetchResult>) { ++*done; };
+
+    net::co_spawn(ex, proxy::http_get_multiple(ctx, ctx.scheduler.flow(1), large), count_done);
+    // The large batch takes the whole limit and queues the rest
+    CHECK(co_await wait_until([&] { return upstream.requests().size() == upstream_limit; },
+                              2s));
+
+    net::co_spawn(ex, proxy::http_get_multiple(ctx, ctx.scheduler.flow(1), small), count_done);
+    CHECK(co_await wait_until([&] { return *done == 2; }, 10s));
+
+    // The clients alternate as slots free up
+    const auto &requests = upstream.requests();
+    CHECK(requests.size() == large.size() + small.size());
+    const auto last_small = std::find(requests.rbegin(), requests.rend(), "/small");
+    const auto served_by = static_cast<size_t>(requests.rend() - last_small);
+    CHECK(last_small != requests.rend());
+    CHECK(served_by <= upstream_limit + 2 * small.size());
+
+    upstream.stop();
+}
+
+int
+main() {
+    spdlog::set_level(spdlog::level::off);
+
+    auto config = proxy::ProxyConfig::from_options(Options {});
+    auto &limit = config.upstream.limit;
+    limit.initial = limit.min = limit.max = upstream_limit;
+    proxy::ProxyContext ctx {config};
+
+    run_test("small_batch_is_not_stuck_behind_large_one",
+             small_batch_is_not_stuck_behind_large_one(ctx));
+    return exit_status();
+}
@@ -0,0 +1,122 @@
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/system/system_error.hpp>
+
+#include "check.hh"
+#include "happy_eyeballs.hh"
+
+namespace net = boost::asio;
+using boost::system::error_code;
+using net::ip::tcp;
+using namespace std::chrono_literals;
+
+using clock_type = std::chrono::steady_clock;
+using Reports = std::vector<std::pair<tcp::endpoint, error_code>>;
+
+// Loopback endpoint that never answers: a listener with a full accept
+// queue, so the kernel drops the SYNs of further connections
+class Blackhole {
+public:
+    explicit Blackhole(net::io_context &ioc): m_acceptor {ioc} {
+        m_acceptor.open(tcp::v4());
+        m_acceptor.bind({net::ip::address_v4::loopback(), 0});
+        m_acceptor.listen(0);
+
+        // Connections never accepted; the first ones fill the queue. The
+        // connects start right away, but `ioc` never runs their handlers.
+        m_fill.reserve(4);
+        for(int i = 0; i < 4; ++i) {
+            m_fill.emplace_back(ioc).async_connect(endpoint(), [](error_code) {});
+        }
+        std::this_thread::sleep_for(50ms);
+    }
+
+    tcp::endpoint endpoint() const {
+        return m_acceptor.local_endpoint();
+    }
+
+private:
+    tcp::acceptor m_acceptor;
+    std::vector<tcp::socket> m_fill;
+};
+
+// Endpoint that completes connections (the kernel accepts them for us)
+class Listener {
+public:
+    explicit Listener(net::io_context &ioc):
+        m_acceptor {ioc, {net::ip::address_v4::loopback(), 0}} {}
+
+    tcp::endpoint endpoint() const {
+        return m_acceptor.local_endpoint();
+    }
+
+private:
+    tcp::acceptor m_acceptor;
+};
+
+// The attempt to a blackholed endpoint is raced by the next one after the
+// stagger delay, which wins right away
+net::awaitable<void>
+falls_back_after_stagger_delay(tcp::endpoint blackhole, tcp::endpoint good) {
+    constexpr auto delay = 200ms;
+    tcp::socket socket {co_await net::this_coro::executor};
+    const std::vector<tcp::endpoint> candidates {blackhole, good};
+    auto reports = std::make_shared<Reports>();
+    // Named: GCC 12 destroys lambda temporaries of a co_await expression twice
+    const auto report = [reports](const tcp::endpoint &ep, error_code ec) {
+        reports->emplace_back(ep, ec);
+    };
+
+    const auto start = clock_type::now();
+    const auto endpoint =
+        co_await happy_eyeballs::async_connect(socket, candidates, 10s, {}, report, delay);
+    const auto elapsed = clock_type::now() - start;
+
+    CHECK(endpoint == good);
+    CHECK(socket.is_open());
+    CHECK(elapsed >= delay);
+    CHECK(elapsed < 2 * delay);
+    // The losing attempt says nothing about its endpoint
+    CHECK(*reports == (Reports {{good, error_code {}}}));
+}
+
+// Attempts cut off by the overall timeout are reported as timed out
+net::awaitable<void>
+reports_timed_out_attempts(tcp::endpoint blackhole) {
+    tcp::socket socket {co_await net::this_coro::executor};
+    const std::vector<tcp::endpoint> candidates {blackhole};
+    auto reports = std::make_shared<Reports>();
+    const auto report = [reports](const tcp::endpoint &ep, error_code ec) {
+        reports->emplace_back(ep, ec);
+    };
+
+    error_code result;
+    try {
+        co_await happy_eyeballs::async_connect(socket, candidates, 200ms, {}, report);
+    } catch(const boost::system::system_error &e) {
+        result = e.code();
+    }
+
+    CHECK(result == net::error::timed_out);
+    CHECK(*reports == (Reports {{blackhole, net::error::timed_out}}));
+}
+
+int
+main() {
+    net::io_context fixtures;
+    const Blackhole blackhole {fixtures};
+    const Listener good {fixtures};
+
+    run_test("falls_back_after_stagger_delay",
+             falls_back_after_stagger_delay(blackhole.endpoint(), good.endpoint()));
+    run_test("reports_timed_out_attempts", reports_timed_out_attempts(blackhole.endpoint()));
+    return exit_status();
+}
@@ -0,0 +1,153 @@
+#ifndef UPSTREAMS_HH_
+#define UPSTREAMS_HH_
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+// Loopback upstream servers for the proxy tests
+
+// Upstream that accepts connections and never answers, counting the ones
+// still open
+class SilentUpstream {
+public:
+    explicit SilentUpstream(boost::asio::any_io_executor ex):
+        m_acceptor {ex, {boost::asio::ip::address_v4::loopback(), 0}} {
+        boost::asio::co_spawn(ex, accept(), boost::asio::detached);
+    }
+
+    unsigned short port() const {
+        return m_acceptor.local_endpoint().port();
+    }
+
+    size_t open() const {
+        return *m_open;
+    }
+
+    void stop() {
+        boost::system::error_code ignored;
+        m_acceptor.close(ignored);
+    }
+
+private:
+    using tcp = boost::asio::ip::tcp;
+
+    boost::asio::awaitable<void> accept() {
+        for(;;) {
+            boost::system::error_code ec;
+            auto socket = co_await m_acceptor.async_accept(
+                boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+            if(ec) {
+                co_return;
+            }
+            ++*m_open;
+            boost::asio::co_spawn(m_acceptor.get_executor(), drain(std::move(socket), m_open),
+                                  boost::asio::detached);
+        }
+    }
+
+    // Read until the connection is closed
+    static boost::asio::awaitable<void> drain(tcp::socket socket,
+                                              std::shared_ptr<size_t> open) {
+        char buffer[512];
+        boost::system::error_code ec;
+        while(!ec) {
+            co_await socket.async_read_some(
+                boost::asio::buffer(buffer),
+                boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        }
+        --*open;
+    }
+
+    tcp::acceptor m_acceptor;
+    std::shared_ptr<size_t> m_open = std::make_shared<size_t>(0);
+};
+
+// HTTP upstream answering every request with "ok" after `delay`. It
+// records the targets requested, in the order the requests arrived.
+class SlowUpstream {
+public:
+    SlowUpstream(boost::asio::any_io_executor ex, std::chrono::steady_clock::duration delay):
+        m_acceptor {ex, {boost::asio::ip::address_v4::loopback(), 0}} {
+        boost::asio::co_spawn(ex, accept(delay), boost::asio::detached);
+    }
+
+    unsigned short port() const {
+        return m_acceptor.local_endpoint().port();
+    }
+
+    const std::vector<std::string> &requests() const {
+        return *m_requests;
+    }
+
+    void stop() {
+        boost::system::error_code ignored;
+        m_acceptor.close(ignored);
+    }
+
+private:
+    using tcp = boost::asio::ip::tcp;
+    using requests_type = std::shared_ptr<std::vector<std::string>>;
+
+    boost::asio::awaitable<void> accept(std::chrono::steady_clock::duration delay) {
+        for(;;) {
+            boost::system::error_code ec;
+            auto socket = co_await m_acceptor.async_accept(
+                boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+            if(ec) {
+                co_return;
+            }
+            boost::asio::co_spawn(m_acceptor.get_executor(),
+                                  serve(std::move(socket), delay, m_requests),
+                                  boost::asio::detached);
+        }
+    }
+
+    // Answer a single request
+    static boost::asio::awaitable<void> serve(tcp::socket socket,
+                                              std::chrono::steady_clock::duration delay,
+                                              requests_type requests) {
+        namespace http = boost::beast::http;
+        boost::system::error_code ec;
+
+        boost::beast::flat_buffer buffer;
+        http::request<http::empty_body> request;
+        co_await http::async_read(socket, buffer, request,
+                                  boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        if(ec) {
+            co_return;
+        }
+        requests->emplace_back(request.target());
+
+        boost::asio::steady_timer timer {socket.get_executor(), delay};
+        co_await timer.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+
+        http::response<http::string_body> response {http::status::ok, request.version()};
+        response.body() = "ok";
+        response.keep_alive(false);
+        response.prepare_payload();
+        co_await http::async_write(
+            socket, response, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        socket.shutdown(tcp::socket::shutdown_send, ec);
+    }
+
+    tcp::acceptor m_acceptor;
+    requests_type m_requests = std::make_shared<std::vector<std::string>>();
+};
+
+#endif